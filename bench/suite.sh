@@ -0,0 +1,137 @@
+#!/bin/sh
+# Benchmark suite behind `make bench`. Runs these scenarios through
+# `boids --bench`, collecting one CSV row per run and mode in $OUT:
+#
+#   scaling    500, 5k, 50k and 1M boids (the window grows with the flock so
+#              the density stays about the same), every mode, on 1 thread
+#              and on all cores
+#   threads    50k boids in the flocking mode on 1, 2, 4, ... cores
+#   renderers  500 and 50k boids drawn with lines, segments, points, shm
+#              and, if ./boids-gl is built, gl. Needs $DISPLAY; skipped
+#              without one
+#
+# Every scenario runs $REPEAT times (3 by default) and only the fastest
+# run counts, which filters out most of the noise from other load. Each is
+# then compared with the same scenario in $BASELINE. The run fails if the
+# median step time or the median draw time
+# grew by more than $TOLERANCE (a fraction, 0.25 by default) and by more
+# than $MIN_MS milliseconds, so noise on tiny timings does not trip it.
+# Scenarios missing from the baseline are listed but do not fail.
+#
+# --update records the results as the new baseline instead. Baselines only
+# mean something on the machine they were recorded on, so one whose machine
+# column (CPU model and cores) differs from this run's is treated as missing.
+# Without a baseline for this machine nothing is compared and the run fails,
+# unless ALLOW_NO_BASELINE=1 is set.
+set -eu
+
+BOIDS=${BOIDS:-./boids}
+BOIDS_GL=${BOIDS_GL:-./boids-gl}
+OUT=${OUT:-bench/results.csv}
+BASELINE=${BASELINE:-bench/baseline.csv}
+TOLERANCE=${TOLERANCE:-0.25}
+MIN_MS=${MIN_MS:-0.05}
+REPEAT=${REPEAT:-3}
+CORES=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+
+rm -f "$OUT"
+
+# run BINARY BOIDS SIZE FRAMES THREADS MODE [--render NAME]
+run() {
+    binary=$1 boids=$2 size=$3 frames=$4 threads=$5 mode=$6
+    shift 6
+    i=0
+    while [ "$i" -lt "$REPEAT" ]; do
+        "$binary" --bench --boids "$boids" --size "$size" --frames "$frames" \
+            --threads "$threads" --mode "$mode" --bench-csv "$OUT" "$@"
+        i=$((i + 1))
+    done
+}
+
+thread_counts="1"
+[ "$CORES" -gt 1 ] && thread_counts="1 $CORES"
+
+for threads in $thread_counts; do
+    run "$BOIDS" 500 1920x1080 1000 "$threads" all
+    run "$BOIDS" 5000 1920x1080 500 "$threads" all
+    run "$BOIDS" 50000 7680x4320 100 "$threads" all
+    run "$BOIDS" 1000000 16384x16384 30 "$threads" all
+done
+
+threads=2
+while [ "$threads" -le "$CORES" ]; do
+    [ "$threads" -ne "$CORES" ] && run "$BOIDS" 50000 7680x4320 100 "$threads" normal
+    threads=$((threads * 2))
+done
+
+if [ -n "${DISPLAY:-}" ]; then
+    for boids in 500 50000; do
+        for renderer in lines segments points shm; do
+            run "$BOIDS" "$boids" 1920x1080 200 "$CORES" normal --render "$renderer"
+        done
+        if [ -x "$BOIDS_GL" ]; then
+            run "$BOIDS_GL" "$boids" 1920x1080 200 "$CORES" normal --render gl
+        fi
+    done
+else
+    echo "bench: no DISPLAY, skipping the renderer scenarios"
+fi
+
+if [ "${1:-}" = "--update" ]; then
+    cp "$OUT" "$BASELINE"
+    echo "bench: recorded $BASELINE"
+    exit 0
+fi
+# no_baseline REASON
+no_baseline() {
+    echo "bench: *** NO BASELINE FOR THIS MACHINE, NOTHING COMPARED ***"
+    echo "bench: $1; run make bench-baseline to record one"
+    [ "${ALLOW_NO_BASELINE:-0}" = 1 ] && exit 0
+    exit 1
+}
+if [ ! -f "$BASELINE" ]; then
+    no_baseline "$BASELINE does not exist"
+fi
+machine() {
+    awk -F, 'FNR == 2 { print $15; exit }' "$1"
+}
+if [ "$(machine "$BASELINE")" != "$(machine "$OUT")" ]; then
+    no_baseline "$BASELINE was recorded on another machine ($(machine "$BASELINE"))"
+fi
+
+# Columns: 1 boids, 2 width, 3 height, 4 threads, 6 mode, 7 renderer,
+# 9 step_p50_ms, 14 draw_p50_ms
+awk -F, -v tolerance="$TOLERANCE" -v min_ms="$MIN_MS" '
+    FNR == 1 { next }
+    { key = $1 "," $2 "x" $3 "," $4 " threads," $6 "," $7 }
+    # The fastest of the repeated runs, for the baseline and the results
+    NR == FNR {
+        if (!(key in step) || $9 < step[key]) step[key] = $9
+        if (!(key in draw) || $14 < draw[key]) draw[key] = $14
+        next
+    }
+    !(key in step) { fresh[key] = 1; next }
+    {
+        if (!(key in now_step) || $9 < now_step[key]) now_step[key] = $9
+        if (!(key in now_draw) || $14 < now_draw[key]) now_draw[key] = $14
+        order[++n] = key
+    }
+    END {
+        for (key in fresh) print "bench: new scenario " key
+        for (i = 1; i <= n; i++) {
+            key = order[i]
+            if (done[key]++) continue
+            regressed(key, "step", now_step[key], step[key])
+            regressed(key, "draw", now_draw[key], draw[key])
+        }
+        if (failed) exit 1
+        print "bench: no regressions"
+    }
+    function regressed(key, name, now, then) {
+        if (now > then * (1 + tolerance) && now - then > min_ms) {
+            printf "bench: REGRESSION %s: %s p50 %.3f ms, baseline %.3f ms\n",
+                   key, name, now, then
+            failed = 1
+        }
+    }
+' "$BASELINE" "$OUT"
@@ -10,16 +10,70 @@
  */
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/dpms.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#ifdef USE_GL
+#include <GL/gl.h>
+#include <GL/glx.h>
+#include <GL/glext.h>
+#endif
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <ctype.h>
+#include <assert.h>
 #include <X11/keysym.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
+#include <pthread.h>
 
-#define NUM_BOIDS 500
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define DEFAULT_NUM_BOIDS 500
+// Boids added or removed per +/- key press
+#define BOIDS_STEP 100
+// Alignment of every per-boid array in the arena (a cache line)
+#define ARENA_ALIGN 64
+// Steps between two reorders of the boid storage (--sort-interval)
+#define SORT_INTERVAL 64
+// Ghost margin of a --tiles partition
+#define TILE_HALO NEIGHBOR_RADIUS
+// Snapshot file header
+#define SNAPSHOT_MAGIC 0x44494f42u   // "BOID" read as a little-endian word
+#define SNAPSHOT_VERSION 4
+// --record file header
+#define RECORDING_MAGIC 0x43455242u  // "BREC"
+#define RECORDING_VERSION 1
+// Recorded velocities are stored in 1/RECORDING_VELOCITY_SCALE px per step
+#define RECORDING_VELOCITY_SCALE 32
+// --compact velocities are stored in 1/COMPACT_VELOCITY_SCALE px per step,
+// which leaves room for 4 * MAX_SPEED
+#define COMPACT_VELOCITY_SCALE 2048
+// Slots of slack after the --compact arrays, one 16-bit vector
+#define COMPACT_PAD 8
 #define MAX_SPEED 4.0
 #define NEIGHBOR_RADIUS 50
 #define ALIGNMENT_WEIGHT 0.05
@@ -31,16 +85,68 @@
 #define PHI 1.61803398875
 #define E 2.71828182846
 
+// Below this many boids per frame the worker pool is not worth waking up
+#define PARALLEL_MIN_ITEMS 2048
+// Boids handed to a worker at a time
+#define PARALLEL_CHUNK 256
+
+// The simulation runs at a fixed rate; all the weights above are per step
+#define SIM_HZ 60
+#define SIM_DT (1.0 / SIM_HZ)
+// At most this many simulation steps per rendered frame. When the machine
+// cannot keep up the remaining time is dropped instead of the frame.
+#define MAX_SUBSTEPS 4
+#define DEFAULT_FPS 60
+
+// Quality governor (--budget): frames it waits between level changes, the
+// smoothing of the measured frame cost, and the fraction of the budget below
+// which it raises quality again
+#define GOVERNOR_HOLD_FRAMES 30
+#define GOVERNOR_SMOOTHING 0.1
+#define GOVERNOR_RECOVER 0.6
+#define GOVERNOR_MAX_LEVEL 3
+
+// Pattern target tables hold this many samples per 2*PI of curve parameter
+#define PATTERN_TABLE_DENSITY 2048
+// Longest period --patterns accepts (a 64K-sample table)
+#define PATTERN_MAX_PERIOD (64 * PI)
+
+// Tile size (pixels) of the damage map used by --damage
+#define DAMAGE_TILE 64
+
+// While nothing is visible the loop wakes up this often (seconds) to poll
+// the monitor power state
+#define IDLE_POLL 1.0
+
+// The HUD and --stats-file report averages over this many seconds
+#define STATS_PERIOD 1.0
+#define HUD_LINES 9
+#define HUD_LINE_HEIGHT 14
+#define HUD_WIDTH 320
+
+// Defaults for --bench
+#define BENCH_FRAMES 1000
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_SEED 1
+
 // Time intervals for auto (screensaver) mode (in seconds)
 #define BOIDS_TIME 30
 #define PATTERN_TIME 35
+// Default length of a mode transition in seconds of simulated time
+#define TRANSITION_TIME 2.0
 
+// Boid state is kept as separate arrays (structure of arrays) so the neighbor
+// loops only pull positions and velocities through the cache. The arrays
+// live in the boid arena, see alloc_boids().
 typedef struct {
-    float x, y;
-    float vx, vy;
-    float target_x, target_y;
-    int index;
-} Boid;
+    float *x, *y;
+    float *vx, *vy;
+    float *target_x, *target_y;
+    float *prev_x, *prev_y;   // positions before the last step
+    float *sep_vx, *sep_vy;   // last pattern separation impulse
+    int *index;
+} Boids;
 
 typedef enum {
     MODE_NORMAL,
@@ -54,13 +160,315 @@ typedef enum {
     MODE_CARDIOID
 } FlockingMode;
 
-Boid boids[NUM_BOIDS];
+#define NUM_MODES (MODE_CARDIOID + 1)
+// Modes loaded with --patterns follow the built-in ones
+#define MAX_PATTERN_FILE_MODES 9
+#define MAX_MODES (NUM_MODES + MAX_PATTERN_FILE_MODES)
+
+const char *mode_names[MAX_MODES] = {
+    "normal", "lissajous", "rose", "hypocycloid", "butterfly",
+    "maurer", "spirograph", "fermat", "cardioid"
+};
+int num_modes = NUM_MODES;
+
+// Wall time spent in each phase of the last update_boids call (seconds)
+typedef struct {
+    double grid;       // neighbor search: building the spatial grid
+    double forces;     // neighbor scans and force accumulation
+    double integrate;  // speed limit, movement and wraparound
+} StepTiming;
+
+Boids boids;
+int num_boids = DEFAULT_NUM_BOIDS;
+int boid_capacity = 0;
+void *boid_arena = NULL;
+// How boids are drawn into the back buffer
+typedef enum {
+    RENDER_LINES,     // one XDrawLine request per boid
+    RENDER_SEGMENTS,  // all boids batched into XDrawSegments requests
+    RENDER_POINTS,    // one pixel per boid, batched into XDrawPoints requests
+    RENDER_SHM,       // rasterized client side into a MIT-SHM XImage
+    RENDER_GL         // instanced lines through OpenGL (built with -DUSE_GL)
+} RenderBackend;
+
+const char *render_names[] = { "lines", "segments", "points", "shm", "gl" };
+
 FlockingMode current_mode = MODE_NORMAL;
 float pattern_time = 0.0;
+
+// --transition SECONDS: a mode change fades the old mode's forces into the
+// new one's over this much simulated time instead of switching at once, so
+// the flock does not rush its new targets all together. 0 switches at once.
+float transition_seconds = TRANSITION_TIME;
+float transition_progress = 1;    // 0 .. 1, 1 when no transition runs
+
+// The modes a transition fades out, each with the share of the blend it
+// had when the transition started (the shares add up to 1). A mode change
+// while a transition runs starts the next one from the current blend, so
+// no mode's forces ever jump; only past MAX_FADING_MODES does the weakest
+// one get dropped.
+#define MAX_FADING_MODES 3
+typedef struct {
+    int32_t mode;
+    float time;       // its pattern_time
+    float weight;
+} FadingMode;
+
+FadingMode fading[MAX_FADING_MODES];
+int num_fading = 0;
 int auto_mode = 0;
+RenderBackend render_backend = RENDER_SEGMENTS;
+StepTiming step_timing;
+unsigned long sim_step = 0;
+// Neighbors found by the last step, summed over all boids
+long step_neighbors = 0;
+
+// Per-frame phases reported by the HUD and --stats-file
+typedef enum {
+    PHASE_EVENTS,
+    PHASE_AUTO,        // check_auto_mode_timing
+    PHASE_NEIGHBORS,   // spatial grid
+    PHASE_FORCES,      // force kernels and integration
+    PHASE_DRAW,
+    PHASE_FLUSH,
+    NUM_PHASES
+} FramePhase;
+
+const char *phase_names[NUM_PHASES] = {
+    "events", "auto", "neighbors", "forces", "draw", "flush"
+};
+
+// Totals since the last report, and the report itself
+typedef struct {
+    double phase[NUM_PHASES];
+    double neighbors;        // neighbors found, summed over boid steps
+    double boid_steps;
+    int frames, missed;
+    double start;
+} FrameStats;
+
+FrameStats frame_stats;
+int show_hud = 0;
+FILE *stats_file = NULL;
+char hud_lines[HUD_LINES][64];
+
+// Quality knobs. They stay at full quality unless the governor lowers them.
+int neighbor_cap = 0;           // max candidates scanned per grid row, 0 = all
+int separation_interval = 1;    // pattern modes: recompute separation every N steps
+float step_scale = 1;           // each simulation step covers this many SIM_DT
+
+typedef struct {
+    double budget;      // seconds per frame, 0 = governor disabled
+    double cost;        // smoothed simulate + render time per frame
+    int level;
+    int hold;           // frames left before the level may change again
+} Governor;
+
+Governor governor = { 0 };
 time_t last_mode_change;
 FlockingMode last_pattern_mode = MODE_LISSAJOUS;
 
+// xorshift64* state. Private so that a given --seed always produces the same
+// flock and the same sequence of auto-mode patterns.
+uint64_t random_state = 1;
+
+// Uniform grid for neighbor queries, rebuilt once per frame with a counting
+// sort and shared by every mode.
+// cell_boids holds boid indices grouped by cell, cell_start[c] is the offset of
+// cell c in it (with one extra entry at the end). sorted_* are copies of the
+// boid positions and velocities in that same order, so every cell (and every
+// row of three adjacent cells) is a contiguous run the SIMD kernels can stream.
+// The grid tiles the window exactly (cells are at least NEIGHBOR_RADIUS on a
+// side) so it can wrap around like the boids do. With --net it does not wrap
+// horizontally; instead it has one extra column on each side for the ghosts
+// sent by the neighboring nodes.
+int grid_cols = 0, grid_rows = 0;
+float grid_width, grid_height;
+float grid_inv_cell_w, grid_inv_cell_h;
+float grid_origin_x;
+int grid_capacity = 0;
+int *cell_start = NULL;
+int *cell_boids;
+int *boid_cell;
+float *sorted_x, *sorted_y;
+float *sorted_vx, *sorted_vy;
+
+// --compact: the grid's read copy is 16-bit fixed point instead of float,
+// 8 bytes per boid instead of 16, written in place of sorted_*. Positions are
+// in units of the same size on both axes, 65536 of them across the longer
+// side. The 16-bit difference of two positions is their offset as long as
+// that is under half the longer side, which it always is for neighbors, even
+// across a wrapped edge. The kernels stay in 16-bit lanes: pmaddwd squares
+// and adds the offsets into 32-bit distances, and adds lanes pairwise into
+// the 32-bit sums. Velocities are in 1/COMPACT_VELOCITY_SCALE px per step.
+int compact_state = 0;
+uint16_t *compact_x, *compact_y;
+int16_t *compact_vx, *compact_vy;
+float compact_scale;    // units per px
+float compact_unit;     // px per unit
+int compact_r2;         // NEIGHBOR_RADIUS squared, in units
+
+// --lod N: in MODE_NORMAL, cells holding more than N boids are seen as one
+// aggregate (mean position and velocity) for alignment and cohesion; only
+// separation still visits their boids. Lower N, down to LOD_MIN_CELL, is
+// faster on dense flocks and rougher; 0 keeps every interaction exact.
+int lod_threshold = 0;
+// Smallest N --lod takes. Below it the mean plus the separation scan cost
+// more than scanning the cell exactly, and the flock only gets slower.
+#define LOD_MIN_CELL 32
+typedef struct {
+    float x, y, vx, vy;
+} CellMean;
+CellMean *cell_means = NULL;
+
+// --sort-interval N: every N steps the boid storage itself is put in grid
+// cell order, so boids that are close in space are close in memory and the
+// per-boid loops walk both their own state and the sorted copy almost
+// sequentially. boids.index goes along with every move, so a boid keeps its
+// pattern phase. 0 disables it.
+int sort_interval = SORT_INTERVAL;
+unsigned long last_sort_step = 0;
+
+// Interpolated positions that are actually drawn
+float *draw_x, *draw_y;
+
+// What the renderers draw: normally draw_x/draw_y and the live velocities,
+// with --pipeline the last frame the simulation thread handed over
+typedef struct {
+    float *x, *y, *vx, *vy;
+    int count;
+    int mode, level;    // for the HUD
+} FrameView;
+FrameView view;
+
+// Worker pool for the simulation step. Workers sleep on pool_wake until the
+// generation changes, then grab pool_chunk-sized ranges of the job until
+// none are left. The calling thread takes part as well.
+typedef void (*RangeJob)(int begin, int end, void *arg);
+
+int num_threads = 1;
+pthread_t *workers = NULL;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+unsigned pool_generation = 0;
+int pool_busy = 0;
+RangeJob pool_job;
+void *pool_arg;
+int pool_items;
+int pool_next;
+int pool_chunk;
+
+// --tiles splits the window into tile_cols x tile_rows partitions for
+// presentation. Each tile owns a contiguous range of boid slots, which the
+// step regroups as boids migrate, and its force and integrate work is one
+// pool item. Forces still read the shared grid, so the flock moves exactly
+// as it does untiled. ghosts lists the boids of other tiles within
+// TILE_HALO of this one (wrapping around like the neighbor queries do), the
+// ones whose lines may reach into the tile; it is rebuilt for every drawn
+// frame, not every step.
+typedef struct {
+    int x, y, width, height;
+    int begin, end;
+    int *ghosts;
+    int num_ghosts, ghost_capacity;
+} Tile;
+
+int tile_cols = 1, tile_rows = 1;
+int num_tiles = 1;
+Tile *tiles = NULL;
+int *boid_tile;
+int *migrate_order;
+float *migrate_scratch;
+
+// Reusable batches for the XDrawSegments / XDrawPoints paths. They belong to
+// the renderer, so they live outside the arena, which --pipeline grows on
+// the simulation thread.
+XSegment *segments = NULL;
+XPoint *points = NULL;
+int batch_capacity = 0;
+
+// Sums gathered over one boid's neighborhood
+typedef struct {
+    float sum_vx, sum_vy;
+    float sum_dx, sum_dy;     // neighbor offsets, for cohesion
+    float avoid_x, avoid_y;
+    int count;
+} NeighborSums;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int parse_mode(const char *name) {
+    for (int m = 0; m < num_modes; ++m) {
+        if (strcmp(name, mode_names[m]) == 0) return m;
+    }
+    return -1;
+}
+
+// The new mode's share of the blend at transition progress p (a smoothstep)
+ALWAYS_INLINE float transition_blend(float p) {
+    return p * p * (3 - 2 * p);
+}
+
+// The progress at which the new mode's share is blend
+float transition_unblend(float blend) {
+    return 0.5f - sinf(asinf(1 - 2 * blend) / 3);
+}
+
+// Switches to mode, fading out the current one (and whatever an unfinished
+// transition was still fading out)
+void set_mode(FlockingMode mode) {
+    if (mode == current_mode) return;
+    if (transition_seconds <= 0) {
+        current_mode = mode;
+        pattern_time = 0;
+        transition_progress = 1;
+        return;
+    }
+
+    // The shares every mode has right now; the mode being left joins the
+    // fading ones with its own, and going back to a mode that is still
+    // fading out resumes it from its share and its pattern clock
+    float blend = transition_progress < 1 ? transition_blend(transition_progress) : 1;
+    if (transition_progress >= 1) num_fading = 0;
+    float start = 0, start_time = 0;
+    int slot = -1;
+    for (int k = 0; k < num_fading; ++k) {
+        fading[k].weight *= 1 - blend;
+        if (fading[k].mode == (int32_t)mode) {
+            slot = k;
+            start = fading[k].weight;
+            start_time = fading[k].time;
+        }
+    }
+    if (slot < 0 && num_fading < MAX_FADING_MODES) {
+        slot = num_fading++;
+    } else if (slot < 0) {
+        // No room: the weakest fading mode gives way
+        slot = 0;
+        for (int k = 1; k < num_fading; ++k) {
+            if (fading[k].weight < fading[slot].weight) slot = k;
+        }
+    }
+    fading[slot] = (FadingMode){ current_mode, pattern_time, blend };
+
+    float total = 0;
+    for (int k = 0; k < num_fading; ++k) {
+        total += fading[k].weight;
+    }
+    for (int k = 0; k < num_fading; ++k) {
+        fading[k].weight = total > 0 ? fading[k].weight / total : 0;
+    }
+    current_mode = mode;
+    pattern_time = start_time;
+    transition_progress = total > 0 ? transition_unblend(start) : 1;
+    if (total <= 0) num_fading = 0;
+}
+
 float get_scale_factor(int width, int height) {
     return fmin(width, height) * 0.3;
 }
@@ -71,263 +479,4298 @@ float clamp(float value, float min, float max) {
     return value;
 }
 
-void limit_speed(Boid *b) {
-    float speed = sqrtf(b->vx * b->vx + b->vy * b->vy);
-    if (speed > MAX_SPEED) {
-        b->vx = (b->vx / speed) * MAX_SPEED;
-        b->vy = (b->vy / speed) * MAX_SPEED;
+void limit_speed(int i) {
+    float speed2 = boids.vx[i] * boids.vx[i] + boids.vy[i] * boids.vy[i];
+    if (speed2 > MAX_SPEED * MAX_SPEED) {
+        float scale = MAX_SPEED / sqrtf(speed2);
+        boids.vx[i] *= scale;
+        boids.vy[i] *= scale;
+    }
+}
+
+// Hands out the next ARENA_ALIGN-aligned block of the arena. With a NULL
+// base it only advances the offset, which is how the total size is measured.
+void *arena_take(char *base, size_t *offset, size_t bytes) {
+    void *p = base ? base + *offset : NULL;
+    *offset += (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return p;
+}
+
+// Lays out every per-boid array for capacity boids in one aligned block.
+// Returns the total size in bytes.
+size_t layout_arena(char *base, int capacity) {
+    size_t offset = 0;
+    size_t floats = capacity * sizeof(float);
+    size_t ints = capacity * sizeof(int);
+
+    boids.x = arena_take(base, &offset, floats);
+    boids.y = arena_take(base, &offset, floats);
+    boids.vx = arena_take(base, &offset, floats);
+    boids.vy = arena_take(base, &offset, floats);
+    boids.target_x = arena_take(base, &offset, floats);
+    boids.target_y = arena_take(base, &offset, floats);
+    boids.prev_x = arena_take(base, &offset, floats);
+    boids.prev_y = arena_take(base, &offset, floats);
+    boids.sep_vx = arena_take(base, &offset, floats);
+    boids.sep_vy = arena_take(base, &offset, floats);
+    boids.index = arena_take(base, &offset, ints);
+
+    cell_boids = arena_take(base, &offset, ints);
+    boid_cell = arena_take(base, &offset, ints);
+    sorted_x = arena_take(base, &offset, floats);
+    sorted_y = arena_take(base, &offset, floats);
+    sorted_vx = arena_take(base, &offset, floats);
+    sorted_vy = arena_take(base, &offset, floats);
+    // The compact kernels read whole vectors past the end of a run
+    size_t shorts = (capacity + COMPACT_PAD) * sizeof(uint16_t);
+    compact_x = arena_take(base, &offset, shorts);
+    compact_y = arena_take(base, &offset, shorts);
+    compact_vx = arena_take(base, &offset, shorts);
+    compact_vy = arena_take(base, &offset, shorts);
+
+    boid_tile = arena_take(base, &offset, ints);
+    migrate_order = arena_take(base, &offset, ints);
+    migrate_scratch = arena_take(base, &offset, floats);
+
+    draw_x = arena_take(base, &offset, floats);
+    draw_y = arena_take(base, &offset, floats);
+    return offset;
+}
+
+// (Re)allocates the arena for at least capacity boids, keeping the state of
+// the active ones. Everything else in the arena is rebuilt every frame.
+void alloc_boids(int capacity) {
+    if (capacity <= boid_capacity) return;
+
+    Boids old = boids;
+    void *old_arena = boid_arena;
+    void *arena = NULL;
+
+    if (posix_memalign(&arena, ARENA_ALIGN, layout_arena(NULL, capacity)) != 0) {
+        fprintf(stderr, "boids: out of memory for %d boids\n", capacity);
+        exit(1);
+    }
+    layout_arena(arena, capacity);
+
+    if (old_arena) {
+        memcpy(boids.x, old.x, num_boids * sizeof(float));
+        memcpy(boids.y, old.y, num_boids * sizeof(float));
+        memcpy(boids.vx, old.vx, num_boids * sizeof(float));
+        memcpy(boids.vy, old.vy, num_boids * sizeof(float));
+        memcpy(boids.target_x, old.target_x, num_boids * sizeof(float));
+        memcpy(boids.target_y, old.target_y, num_boids * sizeof(float));
+        memcpy(boids.prev_x, old.prev_x, num_boids * sizeof(float));
+        memcpy(boids.prev_y, old.prev_y, num_boids * sizeof(float));
+        memcpy(boids.sep_vx, old.sep_vx, num_boids * sizeof(float));
+        memcpy(boids.sep_vy, old.sep_vy, num_boids * sizeof(float));
+        memcpy(boids.index, old.index, num_boids * sizeof(int));
+        free(old_arena);
+    }
+    boid_arena = arena;
+    boid_capacity = capacity;
+}
+
+void seed_random(uint64_t seed) {
+    // Zero is the one state xorshift never leaves
+    random_state = seed ? seed : 0x9e3779b97f4a7c15ull;
+}
+
+uint32_t next_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (uint32_t)((random_state * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+// Uniform in [0, n) for the small n used here
+int random_below(int n) {
+    return (int)(((uint64_t)next_random() * n) >> 32);
+}
+
+void spawn_boid(int i, int width, int height) {
+    boids.x[i] = random_below(width);
+    boids.y[i] = random_below(height);
+    boids.vx[i] = (random_below(100) / 50.0f - 1.0f) * MAX_SPEED;
+    boids.vy[i] = (random_below(100) / 50.0f - 1.0f) * MAX_SPEED;
+    boids.target_x[i] = boids.x[i];
+    boids.target_y[i] = boids.y[i];
+    boids.prev_x[i] = boids.x[i];
+    boids.prev_y[i] = boids.y[i];
+    boids.sep_vx[i] = 0;
+    boids.sep_vy[i] = 0;
+    boids.index[i] = i;
+}
+
+// Copies every per-boid array entry of slot from into slot to
+void copy_boid(int to, int from) {
+    float *arrays[] = { boids.x, boids.y, boids.vx, boids.vy, boids.target_x,
+                        boids.target_y, boids.prev_x, boids.prev_y,
+                        boids.sep_vx, boids.sep_vy };
+    for (size_t a = 0; a < sizeof(arrays) / sizeof(arrays[0]); ++a) {
+        arrays[a][to] = arrays[a][from];
+    }
+    boids.index[to] = boids.index[from];
+}
+
+// Reorders the boid storage so that slot k takes the boid in slot order[k]
+void permute_flock(const int *order) {
+    float *arrays[] = { boids.x, boids.y, boids.vx, boids.vy, boids.target_x,
+                        boids.target_y, boids.prev_x, boids.prev_y,
+                        boids.sep_vx, boids.sep_vy };
+    for (size_t a = 0; a < sizeof(arrays) / sizeof(arrays[0]); ++a) {
+        for (int k = 0; k < num_boids; ++k) {
+            migrate_scratch[k] = arrays[a][order[k]];
+        }
+        memcpy(arrays[a], migrate_scratch, num_boids * sizeof(float));
+    }
+    // boid_tile is only scratch here: partition_flock refills it right
+    // after, and nothing else reads it
+    for (int k = 0; k < num_boids; ++k) {
+        boid_tile[k] = boids.index[order[k]];
+    }
+    memcpy(boids.index, boid_tile, num_boids * sizeof(int));
+}
+
+void init_boids(int width, int height) {
+    alloc_boids(num_boids);
+    for (int i = 0; i < num_boids; ++i) {
+        spawn_boid(i, width, height);
+    }
+}
+
+// Changes the live boid count. The arena grows geometrically so holding a
+// key down does not reallocate on every press; shrinking never frees.
+void resize_flock(int count, int width, int height) {
+    if (count < 1) count = 1;
+    if (count > boid_capacity) {
+        alloc_boids(count > boid_capacity * 2 ? count : boid_capacity * 2);
+    }
+    for (int i = num_boids; i < count; ++i) {
+        spawn_boid(i, width, height);
+    }
+    if (count < num_boids) {
+        // Once the storage has been reordered the last slots are not the
+        // last boids, so keep the ones with the lowest indexes. (With --net
+        // the indexes are not a permutation, and the last slots go.)
+        int keep = 0;
+        for (int i = 0; i < num_boids; ++i) {
+            keep += boids.index[i] < count;
+        }
+        if (keep == count) {
+            int n = 0;
+            for (int i = 0; i < num_boids; ++i) {
+                if (boids.index[i] < count) copy_boid(n++, i);
+            }
+        }
+    }
+    num_boids = count;
+}
+
+// Snapshot header. Multi-byte fields are written in host byte order, so a
+// snapshot is only portable between machines of the same endianness.
+typedef struct {
+    uint32_t magic, version;
+    int32_t num_boids, width, height;
+    int32_t mode, last_pattern_mode;
+    float pattern_time;
+    int32_t num_fading;
+    FadingMode fading[MAX_FADING_MODES];
+    float transition_progress;
+    uint64_t sim_step;
+    uint64_t last_sort_step;
+    uint64_t random_state;
+} SnapshotHeader;
+
+// The float arrays a snapshot holds, in file order. boids.index follows them.
+#define SNAPSHOT_ARRAYS { boids.x, boids.y, boids.vx, boids.vy, boids.target_x, \
+                          boids.target_y, boids.sep_vx, boids.sep_vy }
+#define SNAPSHOT_NUM_ARRAYS 8
+
+// Whether boids.index holds every index below num_boids exactly once. With
+// --net it does not: boids arriving from a neighbor take their slot number.
+int index_is_permutation(void) {
+    char *seen = calloc(num_boids, 1);
+    if (!seen) {
+        fprintf(stderr, "boids: out of memory\n");
+        exit(1);
+    }
+    int ok = 1;
+    for (int i = 0; i < num_boids && ok; ++i) {
+        int k = boids.index[i];
+        if (k < 0 || k >= num_boids || seen[k]) ok = 0;
+        else seen[k] = 1;
+    }
+    free(seen);
+    return ok;
+}
+
+// Writes the flock, mode, pattern clock and any running transition to path. Returns 0 on success.
+int save_snapshot(const char *path, int width, int height) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    SnapshotHeader h = {
+        SNAPSHOT_MAGIC, SNAPSHOT_VERSION, num_boids, width, height,
+        current_mode, last_pattern_mode, pattern_time,
+        num_fading, { { 0 } }, transition_progress, sim_step, last_sort_step, random_state
+    };
+    memcpy(h.fading, fading, sizeof(fading));
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    float *arrays[SNAPSHOT_NUM_ARRAYS] = SNAPSHOT_ARRAYS;
+    for (int a = 0; a < SNAPSHOT_NUM_ARRAYS && ok; ++a) {
+        ok = fwrite(arrays[a], sizeof(float), num_boids, f) == (size_t)num_boids;
+    }
+    // Loading only accepts a permutation, so any other indexes go out in slot order
+    if (index_is_permutation()) {
+        ok = ok && fwrite(boids.index, sizeof(int), num_boids, f) == (size_t)num_boids;
+    } else {
+        for (int i = 0; i < num_boids && ok; ++i) {
+            ok = fwrite(&i, sizeof(int), 1, f) == 1;
+        }
+    }
+    if (fclose(f) != 0) ok = 0;
+
+    if (!ok) {
+        fprintf(stderr, "boids: could not write snapshot '%s'\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+int snapshot_transition_valid(const SnapshotHeader *h) {
+    if (h->num_fading < 0 || h->num_fading > MAX_FADING_MODES ||
+        !(h->transition_progress >= 0 && h->transition_progress <= 1)) return 0;
+    for (int k = 0; k < h->num_fading; ++k) {
+        if (h->fading[k].mode < 0 || h->fading[k].mode >= num_modes) return 0;
+    }
+    return 1;
+}
+
+// Replaces the flock with the one in path. Positions are rescaled when the
+// window is not the size the snapshot was taken at. Returns 0 on success.
+int load_snapshot(const char *path, int width, int height) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    SnapshotHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != SNAPSHOT_MAGIC ||
+        h.version != SNAPSHOT_VERSION || h.num_boids < 1 ||
+        h.width < 1 || h.height < 1 || h.mode < 0 || h.mode >= num_modes ||
+        h.last_pattern_mode < 0 || h.last_pattern_mode >= num_modes ||
+        !snapshot_transition_valid(&h)) {
+        fprintf(stderr, "boids: '%s' is not a snapshot\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    alloc_boids(h.num_boids);
+    num_boids = h.num_boids;
+    int ok = 1;
+    float *arrays[SNAPSHOT_NUM_ARRAYS] = SNAPSHOT_ARRAYS;
+    for (int a = 0; a < SNAPSHOT_NUM_ARRAYS && ok; ++a) {
+        ok = fread(arrays[a], sizeof(float), num_boids, f) == (size_t)num_boids;
+    }
+    ok = ok && fread(boids.index, sizeof(int), num_boids, f) == (size_t)num_boids;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "boids: snapshot '%s' is truncated\n", path);
+        return 1;
+    }
+    if (!index_is_permutation()) {
+        fprintf(stderr, "boids: snapshot '%s' has duplicate or out of range indexes\n", path);
+        return 1;
+    }
+
+    float sx = (float)width / h.width, sy = (float)height / h.height;
+    for (int i = 0; i < num_boids; ++i) {
+        // Rounding can land a rescaled boid on the far edge; anything
+        // inside the window is left alone so a same-size load is exact
+        boids.x[i] *= sx;
+        boids.y[i] *= sy;
+        if (boids.x[i] >= width) boids.x[i] = width - 1;
+        if (boids.y[i] >= height) boids.y[i] = height - 1;
+        boids.target_x[i] *= sx;
+        boids.target_y[i] *= sy;
+        boids.prev_x[i] = boids.x[i];
+        boids.prev_y[i] = boids.y[i];
+    }
+    current_mode = h.mode;
+    last_pattern_mode = h.last_pattern_mode;
+    pattern_time = h.pattern_time;
+    num_fading = h.num_fading;
+    memcpy(fading, h.fading, sizeof(fading));
+    transition_progress = h.transition_progress;
+    sim_step = h.sim_step;
+    last_sort_step = h.last_sort_step;
+    random_state = h.random_state;
+    return 0;
+}
+
+// Recordings hold one frame per simulation step. Positions are quantized to
+// 16-bit fractions of the window at the time of the frame (so wrapping
+// around is free, and a resize while recording cannot overflow them; the
+// header only holds the size the recording started at) and velocities
+// to signed bytes; every value is stored as the zigzag varint of its change
+// since the previous frame, which is usually a single byte. A frame is
+//   varint count, byte step_scale, then per boid: dx, dy, dvx, dvy
+// Boids that did not exist in the previous frame are deltas against zero.
+typedef struct {
+    uint32_t magic, version;
+    int32_t width, height;
+} RecordingHeader;
+
+// Last frame written or read, in quantized form
+typedef struct {
+    uint16_t *x, *y;
+    int8_t *vx, *vy;
+    int count, capacity;
+} RecordingState;
+
+RecordingState record_state, replay_state;
+FILE *record_file = NULL;
+uint8_t *record_buffer = NULL;
+size_t record_buffer_size = 0;
+
+// The mapped --replay file, read one frame per simulation step
+typedef struct {
+    uint8_t *map;
+    size_t size;
+    const uint8_t *data, *cursor, *end;    // end: past the last whole frame
+    int width, height;
+    long frames;
+} Replay;
+
+Replay replay = { 0 };
+
+void recording_reserve(RecordingState *st, int count) {
+    if (count <= st->capacity) return;
+    st->x = realloc(st->x, count * sizeof(uint16_t));
+    st->y = realloc(st->y, count * sizeof(uint16_t));
+    st->vx = realloc(st->vx, count);
+    st->vy = realloc(st->vy, count);
+    if (!st->x || !st->y || !st->vx || !st->vy) {
+        fprintf(stderr, "boids: out of memory for recording\n");
+        exit(1);
+    }
+    // New slots start at zero, which is what their first delta is against
+    for (int i = st->capacity; i < count; ++i) {
+        st->x[i] = st->y[i] = 0;
+        st->vx[i] = st->vy[i] = 0;
+    }
+    st->capacity = count;
+}
+
+ALWAYS_INLINE uint8_t *put_varint(uint8_t *p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// Zigzag maps small negative deltas to small unsigned values
+ALWAYS_INLINE uint8_t *put_delta(uint8_t *p, int delta) {
+    return put_varint(p, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+}
+
+// Returns NULL if the varint runs past end
+ALWAYS_INLINE const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v) {
+    uint32_t value = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t b = *p++;
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = value;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+ALWAYS_INLINE int zigzag_decode(uint32_t v) {
+    return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+ALWAYS_INLINE int8_t quantize_velocity(float v) {
+    int q = (int)lrintf(v * RECORDING_VELOCITY_SCALE);
+    return q > 127 ? 127 : q < -127 ? -127 : q;
+}
+
+void start_recording(const char *path, int width, int height) {
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        perror(path);
+        exit(1);
+    }
+    RecordingHeader h = { RECORDING_MAGIC, RECORDING_VERSION, width, height };
+    if (fwrite(&h, sizeof(h), 1, record_file) != 1) {
+        perror(path);
+        exit(1);
+    }
+}
+
+// Quantizes a coordinate in [0, size) to a 16-bit fraction of size
+ALWAYS_INLINE uint16_t quantize_position(float v, float scale) {
+    int q = (int)(v * scale);
+    return q > 65535 ? 65535 : q < 0 ? 0 : q;
+}
+
+// Appends the current flock as one frame. Flushed every frame so that a
+// screensaver killed at any point leaves a playable file.
+void record_frame(int width, int height) {
+    RecordingState *st = &record_state;
+    recording_reserve(st, num_boids);
+    // At most 5 bytes of count, the step scale and 10 bytes per boid
+    size_t size = 6 + (size_t)num_boids * 10;
+    if (size > record_buffer_size) {
+        record_buffer = realloc(record_buffer, size);
+        if (!record_buffer) {
+            fprintf(stderr, "boids: out of memory for recording\n");
+            exit(1);
+        }
+        record_buffer_size = size;
+    }
+
+    uint8_t *p = put_varint(record_buffer, num_boids);
+    *p++ = (uint8_t)step_scale;
+
+    // Boids go out in index order, so moving them around in storage (tiles,
+    // --sort-interval) does not show up as motion in the deltas. With --net
+    // the indexes are not a permutation and slot order is used instead.
+    int *slot = migrate_order;
+    int ordered = 1;
+    for (int k = 0; k < num_boids; ++k) {
+        slot[k] = -1;
+    }
+    for (int i = 0; i < num_boids && ordered; ++i) {
+        int k = boids.index[i];
+        if (k < 0 || k >= num_boids || slot[k] >= 0) ordered = 0;
+        else slot[k] = i;
+    }
+
+    float sx = 65536.0f / width, sy = 65536.0f / height;
+    for (int k = 0; k < num_boids; ++k) {
+        int i = ordered ? slot[k] : k;
+        uint16_t x = quantize_position(boids.x[i], sx);
+        uint16_t y = quantize_position(boids.y[i], sy);
+        int8_t vx = quantize_velocity(boids.vx[i]);
+        int8_t vy = quantize_velocity(boids.vy[i]);
+        p = put_delta(p, (int16_t)(x - st->x[k]));
+        p = put_delta(p, (int16_t)(y - st->y[k]));
+        p = put_delta(p, vx - st->vx[k]);
+        p = put_delta(p, vy - st->vy[k]);
+        st->x[k] = x;
+        st->y[k] = y;
+        st->vx[k] = vx;
+        st->vy[k] = vy;
+    }
+    // Slots beyond the new count restart from zero if the flock grows again
+    for (int i = num_boids; i < st->count; ++i) {
+        st->x[i] = st->y[i] = 0;
+        st->vx[i] = st->vy[i] = 0;
+    }
+    st->count = num_boids;
+
+    if (fwrite(record_buffer, 1, p - record_buffer, record_file) != (size_t)(p - record_buffer) ||
+        fflush(record_file) != 0) {
+        perror("boids: writing the recording");
+        exit(1);
+    }
+}
+
+// Walks one frame starting at p without decoding it. Returns the start of
+// the next frame, or NULL if the frame is incomplete.
+const uint8_t *skip_replay_frame(const uint8_t *p, const uint8_t *end) {
+    uint32_t count, v;
+    p = get_varint(p, end, &count);
+    if (!p || count < 1 || count > (1u << 24) || p >= end) return NULL;
+    p++;
+    for (uint32_t n = 0; n < count * 4; ++n) {
+        p = get_varint(p, end, &v);
+        if (!p) return NULL;
+    }
+    return p;
+}
+
+// Maps a recording and checks every frame up front, so that playing it back
+// never has to. A trailing partial frame (from a killed recorder) is ignored.
+int open_replay(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RecordingHeader)) {
+        fprintf(stderr, "boids: '%s' is not a recording\n", path);
+        close(fd);
+        return 1;
+    }
+    replay.size = st.st_size;
+    replay.map = mmap(NULL, replay.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay.map == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+    madvise(replay.map, replay.size, MADV_SEQUENTIAL);
+
+    RecordingHeader h;
+    memcpy(&h, replay.map, sizeof(h));
+    if (h.magic != RECORDING_MAGIC || h.version != RECORDING_VERSION ||
+        h.width < 1 || h.height < 1) {
+        fprintf(stderr, "boids: '%s' is not a recording\n", path);
+        munmap(replay.map, replay.size);
+        return 1;
+    }
+    replay.width = h.width;
+    replay.height = h.height;
+    replay.data = replay.map + sizeof(h);
+
+    const uint8_t *p = replay.data, *end = replay.map + replay.size;
+    const uint8_t *next;
+    while (p < end && (next = skip_replay_frame(p, end))) {
+        p = next;
+        replay.frames++;
+    }
+    if (replay.frames == 0) {
+        fprintf(stderr, "boids: recording '%s' has no frames\n", path);
+        munmap(replay.map, replay.size);
+        return 1;
+    }
+    replay.end = p;
+    replay.cursor = replay.data;
+    return 0;
+}
+
+// Replaces a simulation step: decodes the next frame into the flock,
+// scaled to the current window, and loops back to the start at the end
+void replay_frame(int width, int height) {
+    RecordingState *st = &replay_state;
+    if (replay.cursor >= replay.end) {
+        replay.cursor = replay.data;
+        for (int i = 0; i < st->capacity; ++i) {
+            st->x[i] = st->y[i] = 0;
+            st->vx[i] = st->vy[i] = 0;
+        }
+    }
+
+    uint32_t count, v = 0;
+    const uint8_t *p = get_varint(replay.cursor, replay.end, &count);
+    step_scale = *p++;
+    recording_reserve(st, count);
+    int old_count = num_boids;
+    alloc_boids(count);
+    num_boids = count;
+
+    // Recorded boid k goes to the slot holding index k, so it stays paired
+    // with its previous position however --tiles has moved the slots
+    // around. When the count changes the slots start over in order, and
+    // nothing is interpolated for that step.
+    int *slot = migrate_order;
+    int ordered = count == (uint32_t)old_count;
+    for (int k = 0; k < num_boids; ++k) {
+        slot[k] = -1;
+    }
+    for (int i = 0; i < num_boids && ordered; ++i) {
+        int k = boids.index[i];
+        if (k < 0 || k >= num_boids || slot[k] >= 0) ordered = 0;
+        else slot[k] = i;
+    }
+    if (!ordered) {
+        for (int i = 0; i < num_boids; ++i) {
+            boids.index[i] = slot[i] = i;
+        }
+    }
+
+    float sx = (float)width / 65536, sy = (float)height / 65536;
+    float sv = 1.0f / RECORDING_VELOCITY_SCALE;
+    for (int k = 0; k < num_boids; ++k) {
+        p = get_varint(p, replay.end, &v);
+        st->x[k] += zigzag_decode(v);
+        p = get_varint(p, replay.end, &v);
+        st->y[k] += zigzag_decode(v);
+        p = get_varint(p, replay.end, &v);
+        st->vx[k] += zigzag_decode(v);
+        p = get_varint(p, replay.end, &v);
+        st->vy[k] += zigzag_decode(v);
+
+        int i = slot[k];
+        boids.x[i] = st->x[k] * sx;
+        boids.y[i] = st->y[k] * sy;
+        boids.vx[i] = st->vx[k] * sv;
+        boids.vy[i] = st->vy[k] * sv;
+        if (!ordered) {
+            boids.prev_x[i] = boids.x[i];
+            boids.prev_y[i] = boids.y[i];
+        }
+    }
+    for (int i = num_boids; i < st->count; ++i) {
+        st->x[i] = st->y[i] = 0;
+        st->vx[i] = st->vy[i] = 0;
+    }
+    st->count = num_boids;
+    replay.cursor = p;
+}
+
+// --net: the wall is a row of nodes, each simulating the part of the world
+// its own window shows. Node k's right neighbor is node k + 1 (wrapping
+// around), and local x no longer wraps: boids that leave the window migrate
+// to the neighbor on that side, and boids within NEIGHBOR_RADIUS of an edge
+// are sent to that neighbor as ghosts, which its grid sees in one extra
+// column beyond the edge. Every simulation step each node sends one batch
+// per neighbor and waits (up to NET_TIMEOUT) for the neighbors' next batch,
+// which keeps the nodes in frame lock. A neighbor that stops answering is
+// treated as absent, and the edge towards it wraps locally until it is back.
+//
+// A batch is one or more datagrams of
+//   u32 magic, u32 step, u32 ack, u8 parts, u8 part, u8 side, u8 mode,
+//   f32 pattern_time, u16 migrants, u16 ghosts
+// followed by that many migrants (u32 sent, then a record) and ghost
+// records, a record being
+//   s16 x, u16 y, s16 vx, s16 vy
+// x is relative to the shared edge in 1/64 px, y a 16-bit fraction of the
+// height, velocities in 1/4096 px per step. Fields are little-endian.
+// side is the edge of the receiver the batch arrives at.
+//
+// Datagrams get lost, and a batch missing one is dropped, so migrants are
+// resent in every batch until the neighbor acknowledges them: ack is the
+// last batch whose migrants the sender took from the receiver, and a
+// migrant's sent field the step it was first sent in, which lets the
+// receiver skip the ones it already has. Migrants towards a neighbor that
+// has not been heard from for NET_GIVE_UP go back into the local flock,
+// wrapped around; a single late batch only pauses them.
+#define NET_MAGIC 0x54454e42u   // "BNET"
+#define NET_HEADER_SIZE 24
+#define NET_RECORD_SIZE 8
+#define NET_MIGRANT_SIZE (4 + NET_RECORD_SIZE)
+// Record bytes per datagram, keeping each well under a 1500-byte MTU
+#define NET_PAYLOAD 1360
+#define NET_MAX_PARTS 255
+#define NET_TIMEOUT 0.05
+#define NET_GIVE_UP 2.0
+
+enum { NET_LEFT, NET_RIGHT };
+
+// Records of one direction, encoded and ready to send or apply
+typedef struct {
+    uint8_t *data;
+    int count, capacity;
+} NetRecords;
+
+// Migrants sent to one neighbor and not acknowledged yet, oldest first,
+// with the step each was first sent in
+typedef struct {
+    NetRecords records;
+    uint32_t *sent;
+    int capacity;
+} NetOutbox;
+
+typedef struct {
+    uint32_t step;          // batch being assembled
+    int parts, received;
+    NetRecords migrants, ghosts;   // migrants: only the ones not taken yet
+    uint32_t latest;        // last complete batch; its migrants are taken
+    int fresh;              // latest has not been used by a step yet
+    NetRecords latest_ghosts;
+    int mode;
+    float pattern_time;
+} NetInbox;
+
+typedef struct {
+    int node, count;        // count is 0 when not networked
+    int fd;
+    struct sockaddr_storage peer[2];
+    socklen_t peer_len[2];
+    int alive[2];
+    double heard[2];          // when each neighbor last sent anything
+    uint32_t step;
+    NetOutbox outgoing[2];    // migrants to each neighbor, until acknowledged
+    NetRecords incoming[2];   // migrants arrived at each edge, to be added
+    NetInbox inbox[2];
+    int num_ghosts;           // ghosts stored after the live boids
+} Net;
+
+Net net = { 0 };
+
+ALWAYS_INLINE void put_u16(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+ALWAYS_INLINE void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+ALWAYS_INLINE uint32_t get_u16(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8;
+}
+
+ALWAYS_INLINE uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | get_u16(p + 2) << 16;
+}
+
+ALWAYS_INLINE int16_t clamp_s16(float v) {
+    return v > 32767 ? 32767 : v < -32767 ? -32767 : (int16_t)lrintf(v);
+}
+
+uint8_t *net_reserve(NetRecords *r, int count) {
+    if (r->count + count > r->capacity) {
+        r->capacity = (r->count + count) * 2;
+        r->data = realloc(r->data, (size_t)r->capacity * NET_RECORD_SIZE);
+        if (!r->data) {
+            fprintf(stderr, "boids: out of memory\n");
+            exit(1);
+        }
+    }
+    return r->data + (size_t)r->count * NET_RECORD_SIZE;
+}
+
+// Appends boid i as seen from the edge it is crossing or near. offset is
+// subtracted from x to make it relative to that edge.
+void net_encode(NetRecords *r, int i, float offset, int height) {
+    uint8_t *p = net_reserve(r, 1);
+    put_u16(p, (uint16_t)clamp_s16((boids.x[i] - offset) * 64));
+    put_u16(p + 2, (uint16_t)(int)(boids.y[i] * 65536.0f / height));
+    put_u16(p + 4, (uint16_t)clamp_s16(boids.vx[i] * 4096));
+    put_u16(p + 6, (uint16_t)clamp_s16(boids.vy[i] * 4096));
+    r->count++;
+}
+
+// Queues boid i, which has just left the window on side `to`, for the
+// neighbor there
+void net_queue_migrant(int to, int i, int width, int height) {
+    NetOutbox *out = &net.outgoing[to];
+    if (out->records.count == out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 64;
+        out->sent = realloc(out->sent, out->capacity * sizeof(uint32_t));
+        if (!out->sent) {
+            fprintf(stderr, "boids: out of memory\n");
+            exit(1);
+        }
+    }
+    // It goes out with the next exchange's batch
+    out->sent[out->records.count] = net.step + 1;
+    net_encode(&out->records, i, to == NET_RIGHT ? width : 0, height);
+}
+
+// Drops the migrants towards `side` sent in or before step ack
+void net_acknowledge(int side, uint32_t ack) {
+    NetOutbox *out = &net.outgoing[side];
+    int n = 0;
+    while (n < out->records.count && (int32_t)(out->sent[n] - ack) <= 0) n++;
+    if (n == 0) return;
+    out->records.count -= n;
+    memmove(out->records.data, out->records.data + (size_t)n * NET_RECORD_SIZE,
+            (size_t)out->records.count * NET_RECORD_SIZE);
+    memmove(out->sent, out->sent + n, out->records.count * sizeof(uint32_t));
+}
+
+// Decodes a record into slot i for a receiver whose edge on that side is at
+// x = edge
+void net_decode(const uint8_t *p, int i, float edge, int height) {
+    boids.x[i] = edge + (int16_t)get_u16(p) / 64.0f;
+    boids.y[i] = get_u16(p + 2) * (float)height / 65536;
+    boids.vx[i] = (int16_t)get_u16(p + 4) / 4096.0f;
+    boids.vy[i] = (int16_t)get_u16(p + 6) / 4096.0f;
+}
+
+// Resolves "host:port"
+int net_resolve(const char *spec, struct sockaddr_storage *addr, socklen_t *len) {
+    char host[256];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host)) return 1;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    struct addrinfo hints = { 0 }, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return 1;
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// Sets up node `node` of the comma-separated host:port list, binding to its
+// own entry's port
+void net_start(int node, const char *peers) {
+    char *list = strdup(peers);
+    char *entries[256];
+    int count = 0;
+    for (char *tok = strtok(list, ","); tok && count < 256; tok = strtok(NULL, ",")) {
+        entries[count++] = tok;
+    }
+    if (count < 2 || node < 0 || node >= count) {
+        fprintf(stderr, "boids: --net needs a node number below the number of --peers (at least 2)\n");
+        exit(1);
+    }
+
+    struct sockaddr_storage self;
+    socklen_t self_len;
+    int left = (node + count - 1) % count, right = (node + 1) % count;
+    if (net_resolve(entries[node], &self, &self_len) ||
+        net_resolve(entries[left], &net.peer[NET_LEFT], &net.peer_len[NET_LEFT]) ||
+        net_resolve(entries[right], &net.peer[NET_RIGHT], &net.peer_len[NET_RIGHT])) {
+        fprintf(stderr, "boids: could not resolve --peers '%s'\n", peers);
+        exit(1);
+    }
+    free(list);
+
+    ((struct sockaddr_in *)&self)->sin_addr.s_addr = htonl(INADDR_ANY);
+    net.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (net.fd < 0 || bind(net.fd, (struct sockaddr *)&self, self_len) != 0) {
+        perror("boids: --net");
+        exit(1);
+    }
+    fcntl(net.fd, F_SETFL, O_NONBLOCK);
+
+    net.node = node;
+    net.count = count;
+    net.alive[NET_LEFT] = net.alive[NET_RIGHT] = 1;
+    net.heard[NET_LEFT] = net.heard[NET_RIGHT] = now_seconds();
+}
+
+// How many of the migrants and ghosts still to send fit in one datagram:
+// migrants first, ghosts in the room left over
+void net_part_size(int migrants, int ghosts, int *nm, int *ng) {
+    int per_part = NET_PAYLOAD / NET_MIGRANT_SIZE;
+    *nm = migrants < per_part ? migrants : per_part;
+    int room = (NET_PAYLOAD - *nm * NET_MIGRANT_SIZE) / NET_RECORD_SIZE;
+    *ng = ghosts < room ? ghosts : room;
+}
+
+// Sends this step's batch to the neighbor on `to`: its pending migrants and
+// every boid within NEIGHBOR_RADIUS of that edge as a ghost
+void net_send(int to, int width, int height) {
+    static NetRecords ghosts;
+    ghosts.count = 0;
+    // The receiver's edge is on the opposite side; positions are relative
+    // to the edge they share with it
+    float edge = to == NET_RIGHT ? width : 0;
+    for (int i = 0; i < num_boids; ++i) {
+        if (to == NET_RIGHT ? boids.x[i] >= width - NEIGHBOR_RADIUS
+                            : boids.x[i] < NEIGHBOR_RADIUS) {
+            net_encode(&ghosts, i, edge, height);
+        }
+    }
+
+    NetOutbox *out = &net.outgoing[to];
+    int num_migrants = out->records.count;
+    int parts = 0;
+    for (int m = 0, g = 0; parts == 0 || m < num_migrants || g < ghosts.count; ++parts) {
+        int nm, ng;
+        net_part_size(num_migrants - m, ghosts.count - g, &nm, &ng);
+        m += nm;
+        g += ng;
+    }
+    if (parts > NET_MAX_PARTS) {
+        fprintf(stderr, "boids: --net batch of %d migrants and %d ghosts needs more than "
+                "%d datagrams\n", num_migrants, ghosts.count, NET_MAX_PARTS);
+        exit(1);
+    }
+
+    uint8_t packet[NET_HEADER_SIZE + NET_PAYLOAD];
+    uint32_t time_bits;
+    memcpy(&time_bits, &pattern_time, sizeof(time_bits));
+    int m = 0, g = 0;
+    for (int part = 0; part < parts; ++part) {
+        int nm, ng;
+        net_part_size(num_migrants - m, ghosts.count - g, &nm, &ng);
+
+        put_u32(packet, NET_MAGIC);
+        put_u32(packet + 4, net.step);
+        put_u32(packet + 8, net.inbox[to].latest);
+        packet[12] = parts;
+        packet[13] = part;
+        packet[14] = to == NET_RIGHT ? NET_LEFT : NET_RIGHT;
+        packet[15] = current_mode;
+        put_u32(packet + 16, time_bits);
+        put_u16(packet + 20, nm);
+        put_u16(packet + 22, ng);
+        uint8_t *p = packet + NET_HEADER_SIZE;
+        for (int k = 0; k < nm; ++k, ++m, p += NET_MIGRANT_SIZE) {
+            put_u32(p, out->sent[m]);
+            memcpy(p + 4, out->records.data + (size_t)m * NET_RECORD_SIZE, NET_RECORD_SIZE);
+        }
+        memcpy(p, ghosts.data + (size_t)g * NET_RECORD_SIZE, (size_t)ng * NET_RECORD_SIZE);
+        p += (size_t)ng * NET_RECORD_SIZE;
+        g += ng;
+
+        sendto(net.fd, packet, p - packet, 0,
+               (struct sockaddr *)&net.peer[to], net.peer_len[to]);
+    }
+}
+
+void net_append(NetRecords *to, const uint8_t *records, int count) {
+    memcpy(net_reserve(to, count), records, (size_t)count * NET_RECORD_SIZE);
+    to->count += count;
+}
+
+// Reads every datagram waiting on the socket into the inboxes
+void net_receive(void) {
+    uint8_t packet[NET_HEADER_SIZE + NET_PAYLOAD];
+    for (;;) {
+        ssize_t n = recv(net.fd, packet, sizeof(packet), 0);
+        if (n < 0) break;
+        if (n < NET_HEADER_SIZE || get_u32(packet) != NET_MAGIC) continue;
+
+        uint32_t step = get_u32(packet + 4), ack = get_u32(packet + 8);
+        int parts = packet[12], side = packet[14], mode = packet[15];
+        int nm = get_u16(packet + 20), ng = get_u16(packet + 22);
+        if (side > NET_RIGHT || mode >= num_modes || parts < 1 ||
+            n != NET_HEADER_SIZE + (ssize_t)nm * NET_MIGRANT_SIZE +
+                 (ssize_t)ng * NET_RECORD_SIZE) continue;
+
+        NetInbox *in = &net.inbox[side];
+        net.alive[side] = 1;
+        net.heard[side] = now_seconds();
+        net_acknowledge(side, ack);
+        // Late datagrams of a batch that is complete already
+        if ((int32_t)(step - in->latest) <= 0) continue;
+        if (in->received == 0 || step != in->step) {
+            // A newer batch replaces one that lost a datagram; its migrants
+            // are resent with the newer one
+            if (in->received > 0 && (int32_t)(step - in->step) < 0) continue;
+            in->step = step;
+            in->parts = parts;
+            in->received = 0;
+            in->migrants.count = 0;
+            in->ghosts.count = 0;
+        }
+        const uint8_t *p = packet + NET_HEADER_SIZE;
+        for (int k = 0; k < nm; ++k, p += NET_MIGRANT_SIZE) {
+            // Sent before, and taken with an earlier batch
+            if ((int32_t)(get_u32(p) - in->latest) <= 0) continue;
+            net_append(&in->migrants, p + 4, 1);
+        }
+        net_append(&in->ghosts, p, ng);
+
+        if (++in->received == in->parts) {
+            // Migrants are added exactly once; only the newest ghosts count
+            net_append(&net.incoming[side], in->migrants.data, in->migrants.count);
+            in->latest_ghosts.count = 0;
+            net_append(&in->latest_ghosts, in->ghosts.data, in->ghosts.count);
+            in->latest = step;
+            in->fresh = 1;
+            in->mode = mode;
+            uint32_t time_bits = get_u32(packet + 16);
+            memcpy(&in->pattern_time, &time_bits, sizeof(float));
+            in->received = 0;
+        }
+    }
+}
+
+// One frame-locked exchange with both neighbors, run before each step:
+// sends this node's batches, waits for theirs, adds arriving migrants to
+// the flock and stores the ghosts after it
+void net_exchange(int width, int height) {
+    net.step++;
+    net_send(NET_LEFT, width, height);
+    net_send(NET_RIGHT, width, height);
+
+    double deadline = now_seconds() + NET_TIMEOUT;
+    for (;;) {
+        net_receive();
+        int waiting = 0;
+        for (int side = 0; side < 2; ++side) {
+            if (net.alive[side] && !net.inbox[side].fresh) waiting = 1;
+        }
+        double left = deadline - now_seconds();
+        if (!waiting) break;
+        if (left <= 0) {
+            for (int side = 0; side < 2; ++side) {
+                if (!net.inbox[side].fresh) net.alive[side] = 0;
+            }
+            break;
+        }
+        struct pollfd pfd = { net.fd, POLLIN, 0 };
+        poll(&pfd, 1, (int)(left * 1000) + 1);
+    }
+
+    // What was on its way to a neighbor that is gone for good wraps around
+    // to the other edge
+    for (int side = 0; side < 2; ++side) {
+        NetRecords *r = &net.outgoing[side].records;
+        if (net.alive[side] || r->count == 0 || now_seconds() - net.heard[side] < NET_GIVE_UP) {
+            continue;
+        }
+        net_append(&net.incoming[side == NET_LEFT ? NET_RIGHT : NET_LEFT], r->data, r->count);
+        r->count = 0;
+    }
+
+    // The flock's mode follows node 0, one hop further down the wall per step
+    if (net.node > 0 && net.inbox[NET_LEFT].fresh) {
+        set_mode(net.inbox[NET_LEFT].mode);
+        pattern_time = net.inbox[NET_LEFT].pattern_time;
+    }
+
+    int ghosts = 0;
+    for (int side = 0; side < 2; ++side) {
+        if (!net.alive[side]) net.inbox[side].latest_ghosts.count = 0;
+        ghosts += net.inbox[side].latest_ghosts.count;
+        net.inbox[side].fresh = 0;
+    }
+    alloc_boids(num_boids + net.incoming[NET_LEFT].count + net.incoming[NET_RIGHT].count +
+                ghosts);
+
+    for (int side = 0; side < 2; ++side) {
+        NetRecords *r = &net.incoming[side];
+        for (int k = 0; k < r->count; ++k) {
+            int i = num_boids++;
+            net_decode(r->data + (size_t)k * NET_RECORD_SIZE, i,
+                       side == NET_RIGHT ? width : 0, height);
+            if (boids.x[i] < 0) boids.x[i] = 0;
+            if (boids.x[i] >= width) boids.x[i] = width - 1;
+            boids.target_x[i] = boids.prev_x[i] = boids.x[i];
+            boids.target_y[i] = boids.prev_y[i] = boids.y[i];
+            boids.sep_vx[i] = boids.sep_vy[i] = 0;
+            boids.index[i] = i;
+        }
+        r->count = 0;
+    }
+
+    int g = num_boids;
+    for (int side = 0; side < 2; ++side) {
+        NetRecords *r = &net.inbox[side].latest_ghosts;
+        for (int k = 0; k < r->count; ++k) {
+            net_decode(r->data + (size_t)k * NET_RECORD_SIZE, g++,
+                       side == NET_RIGHT ? width : 0, height);
+        }
+    }
+    net.num_ghosts = ghosts;
+}
+
+// After a step: hands every boid that left the window to the neighbor on
+// that side, or wraps it around if that neighbor is absent
+void net_migrate(int width, int height) {
+    for (int i = 0; i < num_boids; ++i) {
+        int to = boids.x[i] < 0 ? NET_LEFT : boids.x[i] >= width ? NET_RIGHT : -1;
+        if (to < 0) continue;
+        if (!net.alive[to]) {
+            boids.x[i] += to == NET_LEFT ? width : -width;
+            continue;
+        }
+        net_queue_migrant(to, i, width, height);
+
+        // Fill the hole with the last boid
+        copy_boid(i, --num_boids);
+        --i;
+    }
+}
+
+// Moves the boids into the cell order build_grid has just produced; the
+// sorted copy then matches the storage slot for slot
+void sort_flock(int num_cells) {
+    permute_flock(cell_boids);
+    for (int c = 0; c < num_cells; ++c) {
+        for (int k = cell_start[c]; k < cell_start[c + 1]; ++k) {
+            cell_boids[k] = k;
+            boid_cell[k] = c;
+        }
+    }
+    last_sort_step = sim_step;
+}
+
+// The --compact unit a coordinate falls in, modulo 65536. A position moved
+// by a window size (as gather_neighbors does for wrapped cells) can fall
+// outside 0..65535; only its offset to nearby boids matters.
+ALWAYS_INLINE uint16_t compact_position(float v) {
+    return (uint16_t)(int)floorf(v * compact_scale);
+}
+
+void build_grid(int width, int height) {
+    int cols = width / NEIGHBOR_RADIUS;
+    int rows = height / NEIGHBOR_RADIUS;
+    if (cols < 1) cols = 1;
+    if (rows < 1) rows = 1;
+    float cell_width = (float)width / cols;
+    float origin = 0;
+    int count = num_boids;
+    if (net.count > 0) {
+        // Live boids land in columns 1..cols, ghosts in 0 and cols + 1, so a
+        // live boid's 3x3 block never leaves the grid and never wraps in x
+        origin = -cell_width;
+        cols += 2;
+        width += 2 * cell_width;
+        count += net.num_ghosts;
+    }
+
+    if (cols * rows + 1 > grid_capacity) {
+        grid_capacity = cols * rows + 1;
+        cell_start = realloc(cell_start, grid_capacity * sizeof(int));
+        cell_means = realloc(cell_means, grid_capacity * sizeof(CellMean));
+        if (!cell_start || !cell_means) {
+            fprintf(stderr, "boids: out of memory\n");
+            exit(1);
+        }
+    }
+    grid_cols = cols;
+    grid_rows = rows;
+    grid_width = width;
+    grid_height = height;
+    grid_inv_cell_w = 1 / cell_width;
+    grid_origin_x = origin;
+    grid_inv_cell_h = (float)rows / height;
+
+    int num_cells = cols * rows;
+    memset(cell_start, 0, (num_cells + 1) * sizeof(int));
+
+    for (int i = 0; i < count; ++i) {
+        int cx = (int)((boids.x[i] - origin) * grid_inv_cell_w);
+        int cy = (int)(boids.y[i] * grid_inv_cell_h);
+        cx = cx < 0 ? 0 : (cx >= cols ? cols - 1 : cx);
+        cy = cy < 0 ? 0 : (cy >= rows ? rows - 1 : cy);
+        boid_cell[i] = cy * cols + cx;
+        cell_start[boid_cell[i] + 1]++;
+    }
+
+    for (int c = 0; c < num_cells; ++c) {
+        cell_start[c + 1] += cell_start[c];
+    }
+
+    // Scatter using cell_start as a running cursor, then shift it back
+    if (compact_state) {
+        const float vmax = 32767.0f / COMPACT_VELOCITY_SCALE;
+        compact_scale = 65536.0f / (width > height ? width : height);
+        compact_unit = 1 / compact_scale;
+        compact_r2 = (int)(NEIGHBOR_RADIUS * compact_scale * NEIGHBOR_RADIUS * compact_scale);
+        for (int i = 0; i < count; ++i) {
+            int k = cell_start[boid_cell[i]]++;
+            cell_boids[k] = i;
+            compact_x[k] = compact_position(boids.x[i]);
+            compact_y[k] = compact_position(boids.y[i]);
+            compact_vx[k] = (int16_t)(clamp(boids.vx[i], -vmax, vmax) * COMPACT_VELOCITY_SCALE);
+            compact_vy[k] = (int16_t)(clamp(boids.vy[i], -vmax, vmax) * COMPACT_VELOCITY_SCALE);
+        }
+    } else {
+        for (int i = 0; i < count; ++i) {
+            int k = cell_start[boid_cell[i]]++;
+            cell_boids[k] = i;
+            sorted_x[k] = boids.x[i];
+            sorted_y[k] = boids.y[i];
+            sorted_vx[k] = boids.vx[i];
+            sorted_vy[k] = boids.vy[i];
+        }
+    }
+    for (int c = num_cells; c > 0; --c) {
+        cell_start[c] = cell_start[c - 1];
+    }
+    cell_start[0] = 0;
+
+    // Also on the first step, when the flock is still in spawn order. Tiles
+    // keep their own slot order, and --net ghosts must stay behind the live
+    // boids.
+    if (sort_interval > 0 && num_tiles <= 1 && net.count == 0 &&
+        (sim_step == 0 || sim_step - last_sort_step >= (unsigned long)sort_interval)) {
+        sort_flock(num_cells);
+    }
+
+    if (lod_threshold > 0) {
+        for (int c = 0; c < num_cells; ++c) {
+            int begin = cell_start[c], end = cell_start[c + 1];
+            if (end - begin <= lod_threshold) continue;
+            // Doubles keep the means exact for cells with many boids
+            double x = 0, y = 0, vx = 0, vy = 0;
+            for (int k = begin; k < end; ++k) {
+                x += sorted_x[k];
+                y += sorted_y[k];
+                vx += sorted_vx[k];
+                vy += sorted_vy[k];
+            }
+            double inv = 1.0 / (end - begin);
+            cell_means[c] = (CellMean){ x * inv, y * inv, vx * inv, vy * inv };
+        }
+    }
+}
+
+// Minimal float vector layer for the neighbor kernels. Masks are all-ones
+// lanes, so AND-ing a mask with a value selects it or yields zero.
+#if defined(__AVX2__)
+#define SIMD_WIDTH 8
+typedef __m256 vfloat;
+#define v_set1(a) _mm256_set1_ps(a)
+#define v_load(p) _mm256_loadu_ps(p)
+#define v_add(a, b) _mm256_add_ps(a, b)
+#define v_sub(a, b) _mm256_sub_ps(a, b)
+#define v_mul(a, b) _mm256_mul_ps(a, b)
+#define v_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define v_and(a, b) _mm256_and_ps(a, b)
+
+static inline float v_sum(vfloat v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE2__)
+#define SIMD_WIDTH 4
+typedef __m128 vfloat;
+#define v_set1(a) _mm_set1_ps(a)
+#define v_load(p) _mm_loadu_ps(p)
+#define v_add(a, b) _mm_add_ps(a, b)
+#define v_sub(a, b) _mm_sub_ps(a, b)
+#define v_mul(a, b) _mm_mul_ps(a, b)
+#define v_lt(a, b) _mm_cmplt_ps(a, b)
+#define v_and(a, b) _mm_and_ps(a, b)
+static inline float v_sum(vfloat v) {
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__ARM_NEON)
+#define SIMD_WIDTH 4
+typedef float32x4_t vfloat;
+#define v_set1(a) vdupq_n_f32(a)
+#define v_load(p) vld1q_f32(p)
+#define v_add(a, b) vaddq_f32(a, b)
+#define v_sub(a, b) vsubq_f32(a, b)
+#define v_mul(a, b) vmulq_f32(a, b)
+#define v_lt(a, b) vreinterpretq_f32_u32(vcltq_f32(a, b))
+#define v_and(a, b) vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), \
+                                                    vreinterpretq_u32_f32(b)))
+
+static inline float v_sum(vfloat v) {
+    float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+#endif
+
+// Accumulates alignment, cohesion and separation sums for the point (px, py)
+// over sorted slots [begin, end). Distances are compared squared; the point
+// itself is skipped by the dist > 0 test.
+void accumulate_neighbors(int begin, int end, float px, float py, NeighborSums *s) {
+    const float r2 = NEIGHBOR_RADIUS * NEIGHBOR_RADIUS;
+    const float sep_r2 = (NEIGHBOR_RADIUS / 2) * (NEIGHBOR_RADIUS / 2);
+    int k = begin;
+
+#ifdef SIMD_WIDTH
+    if (end - begin >= SIMD_WIDTH) {
+        vfloat vpx = v_set1(px), vpy = v_set1(py);
+        vfloat vr2 = v_set1(r2), vsep = v_set1(sep_r2);
+        vfloat zero = v_set1(0.0f), one = v_set1(1.0f);
+        vfloat svx = zero, svy = zero, sx = zero, sy = zero;
+        vfloat ax = zero, ay = zero, cnt = zero;
+
+        for (; k + SIMD_WIDTH <= end; k += SIMD_WIDTH) {
+            vfloat dx = v_sub(v_load(&sorted_x[k]), vpx);
+            vfloat dy = v_sub(v_load(&sorted_y[k]), vpy);
+            vfloat d2 = v_add(v_mul(dx, dx), v_mul(dy, dy));
+            vfloat in = v_and(v_lt(d2, vr2), v_lt(zero, d2));
+            vfloat near = v_and(in, v_lt(d2, vsep));
+
+            svx = v_add(svx, v_and(in, v_load(&sorted_vx[k])));
+            svy = v_add(svy, v_and(in, v_load(&sorted_vy[k])));
+            sx = v_add(sx, v_and(in, dx));
+            sy = v_add(sy, v_and(in, dy));
+            ax = v_sub(ax, v_and(near, dx));
+            ay = v_sub(ay, v_and(near, dy));
+            cnt = v_add(cnt, v_and(in, one));
+        }
+
+        s->sum_vx += v_sum(svx);
+        s->sum_vy += v_sum(svy);
+        s->sum_dx += v_sum(sx);
+        s->sum_dy += v_sum(sy);
+        s->avoid_x += v_sum(ax);
+        s->avoid_y += v_sum(ay);
+        s->count += (int)v_sum(cnt);
+    }
+#endif
+
+    for (; k < end; ++k) {
+        float dx = sorted_x[k] - px;
+        float dy = sorted_y[k] - py;
+        float d2 = dx * dx + dy * dy;
+        if (d2 < r2 && d2 > 0) {
+            s->sum_vx += sorted_vx[k];
+            s->sum_vy += sorted_vy[k];
+            s->sum_dx += dx;
+            s->sum_dy += dy;
+            if (d2 < sep_r2) {
+                s->avoid_x -= dx;
+                s->avoid_y -= dy;
+            }
+            s->count++;
+        }
+    }
+}
+
+// Separation-only variant used by the pattern modes (radius NEIGHBOR_RADIUS/2)
+void accumulate_separation(int begin, int end, float px, float py, NeighborSums *s) {
+    const float sep_r2 = (NEIGHBOR_RADIUS / 2) * (NEIGHBOR_RADIUS / 2);
+    int k = begin;
+
+#ifdef SIMD_WIDTH
+    if (end - begin >= SIMD_WIDTH) {
+        vfloat vpx = v_set1(px), vpy = v_set1(py);
+        vfloat vsep = v_set1(sep_r2);
+        vfloat zero = v_set1(0.0f), one = v_set1(1.0f);
+        vfloat ax = zero, ay = zero, cnt = zero;
+
+        for (; k + SIMD_WIDTH <= end; k += SIMD_WIDTH) {
+            vfloat dx = v_sub(v_load(&sorted_x[k]), vpx);
+            vfloat dy = v_sub(v_load(&sorted_y[k]), vpy);
+            vfloat d2 = v_add(v_mul(dx, dx), v_mul(dy, dy));
+            vfloat near = v_and(v_lt(d2, vsep), v_lt(zero, d2));
+
+            ax = v_sub(ax, v_and(near, dx));
+            ay = v_sub(ay, v_and(near, dy));
+            cnt = v_add(cnt, v_and(near, one));
+        }
+
+        s->avoid_x += v_sum(ax);
+        s->avoid_y += v_sum(ay);
+        s->count += (int)v_sum(cnt);
+    }
+#endif
+
+    for (; k < end; ++k) {
+        float dx = sorted_x[k] - px;
+        float dy = sorted_y[k] - py;
+        float d2 = dx * dx + dy * dy;
+        if (d2 < sep_r2 && d2 > 0) {
+            s->avoid_x -= dx;
+            s->avoid_y -= dy;
+            s->count++;
+        }
+    }
+}
+
+// Running sums of a --compact scan, in units and 32-bit lanes
+typedef struct {
+#ifdef __SSE2__
+    __m128i vx, vy, dx, dy, avoid_x, avoid_y, count;
+#else
+    int vx, vy, dx, dy, avoid_x, avoid_y, count;
+#endif
+} CompactSums;
+
+#ifdef __SSE2__
+// Sum of the four 32-bit lanes
+static inline int v_sum_epi32(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+#endif
+
+// Adds the --compact slots [begin, end) within compact_r2 of (qx, qy) to c,
+// or with separation_only just those within the separation radius. The last
+// vector is cut off at end (the arrays have COMPACT_PAD slots of slack), so
+// no run needs a scalar tail.
+ALWAYS_INLINE void compact_scan(int begin, int end, uint16_t qx, uint16_t qy,
+                                CompactSums *c, int separation_only) {
+    const int r2 = compact_r2, sep_r2 = compact_r2 / 4;
+
+#ifdef __SSE2__
+    __m128i vqx = _mm_set1_epi16((short)qx), vqy = _mm_set1_epi16((short)qy);
+    __m128i vr2 = _mm_set1_epi32(r2), vsep = _mm_set1_epi32(sep_r2);
+    __m128i one = _mm_set1_epi16(1), zero = _mm_setzero_si128();
+    __m128i lanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (int k = begin; k < end; k += 8) {
+        __m128i valid = _mm_cmpgt_epi16(_mm_set1_epi16((short)(end - k > 8 ? 8 : end - k)), lanes);
+        __m128i dx = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)&compact_x[k]), vqx);
+        __m128i dy = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)&compact_y[k]), vqy);
+        // pmaddwd of the interleaved offsets with themselves is dx² + dy²
+        __m128i lo = _mm_unpacklo_epi16(dx, dy), hi = _mm_unpackhi_epi16(dx, dy);
+        __m128i d2lo = _mm_madd_epi16(lo, lo), d2hi = _mm_madd_epi16(hi, hi);
+        __m128i poslo = _mm_cmpgt_epi32(d2lo, zero), poshi = _mm_cmpgt_epi32(d2hi, zero);
+        __m128i near = _mm_and_si128(valid, _mm_packs_epi32(
+            _mm_and_si128(poslo, _mm_cmplt_epi32(d2lo, vsep)),
+            _mm_and_si128(poshi, _mm_cmplt_epi32(d2hi, vsep))));
+
+        // and pmaddwd by one adds neighboring lanes into 32 bits
+        c->avoid_x = _mm_sub_epi32(c->avoid_x, _mm_madd_epi16(_mm_and_si128(near, dx), one));
+        c->avoid_y = _mm_sub_epi32(c->avoid_y, _mm_madd_epi16(_mm_and_si128(near, dy), one));
+        if (separation_only) {
+            c->count = _mm_sub_epi32(c->count, _mm_madd_epi16(near, one));
+            continue;
+        }
+
+        __m128i in = _mm_and_si128(valid, _mm_packs_epi32(
+            _mm_and_si128(poslo, _mm_cmplt_epi32(d2lo, vr2)),
+            _mm_and_si128(poshi, _mm_cmplt_epi32(d2hi, vr2))));
+        __m128i vx = _mm_loadu_si128((const __m128i *)&compact_vx[k]);
+        __m128i vy = _mm_loadu_si128((const __m128i *)&compact_vy[k]);
+        c->vx = _mm_add_epi32(c->vx, _mm_madd_epi16(_mm_and_si128(in, vx), one));
+        c->vy = _mm_add_epi32(c->vy, _mm_madd_epi16(_mm_and_si128(in, vy), one));
+        c->dx = _mm_add_epi32(c->dx, _mm_madd_epi16(_mm_and_si128(in, dx), one));
+        c->dy = _mm_add_epi32(c->dy, _mm_madd_epi16(_mm_and_si128(in, dy), one));
+        c->count = _mm_sub_epi32(c->count, _mm_madd_epi16(in, one));
+    }
+#else
+    for (int k = begin; k < end; ++k) {
+        int dx = (int16_t)(compact_x[k] - qx), dy = (int16_t)(compact_y[k] - qy);
+        int d2 = dx * dx + dy * dy;
+        if (d2 <= 0 || d2 >= (separation_only ? sep_r2 : r2)) continue;
+        if (d2 < sep_r2) {
+            c->avoid_x -= dx;
+            c->avoid_y -= dy;
+        }
+        if (!separation_only) {
+            c->vx += compact_vx[k];
+            c->vy += compact_vy[k];
+            c->dx += dx;
+            c->dy += dy;
+        }
+        c->count++;
+    }
+#endif
+}
+
+// Adds c to s in px
+ALWAYS_INLINE void compact_reduce(const CompactSums *c, NeighborSums *s) {
+#ifdef __SSE2__
+#define COMPACT_SUM(v) v_sum_epi32(v)
+#else
+#define COMPACT_SUM(v) (v)
+#endif
+    const float unit_v = 1.0f / COMPACT_VELOCITY_SCALE;
+    s->sum_vx += COMPACT_SUM(c->vx) * unit_v;
+    s->sum_vy += COMPACT_SUM(c->vy) * unit_v;
+    s->sum_dx += COMPACT_SUM(c->dx) * compact_unit;
+    s->sum_dy += COMPACT_SUM(c->dy) * compact_unit;
+    s->avoid_x += COMPACT_SUM(c->avoid_x) * compact_unit;
+    s->avoid_y += COMPACT_SUM(c->avoid_y) * compact_unit;
+    s->count += COMPACT_SUM(c->count);
+#undef COMPACT_SUM
+}
+
+// accumulate_neighbors over the --compact copy
+void accumulate_neighbors_compact(int begin, int end, float px, float py, NeighborSums *s) {
+    CompactSums c;
+    memset(&c, 0, sizeof(c));
+    compact_scan(begin, end, compact_position(px), compact_position(py), &c, 0);
+    compact_reduce(&c, s);
+}
+
+// accumulate_separation over the --compact copy
+void accumulate_separation_compact(int begin, int end, float px, float py, NeighborSums *s) {
+    CompactSums c;
+    memset(&c, 0, sizeof(c));
+    compact_scan(begin, end, compact_position(px), compact_position(py), &c, 1);
+    compact_reduce(&c, s);
+}
+
+// Adds part to s as if it had been weight times as many boids
+ALWAYS_INLINE void add_scaled_sums(NeighborSums *s, const NeighborSums *part, float weight) {
+    s->sum_vx += part->sum_vx * weight;
+    s->sum_vy += part->sum_vy * weight;
+    s->sum_dx += part->sum_dx * weight;
+    s->sum_dy += part->sum_dy * weight;
+    s->avoid_x += part->avoid_x * weight;
+    s->avoid_y += part->avoid_y * weight;
+    s->count += (int)lrintf(part->count * weight);
+}
+
+// A row run of cells [first, last) holding more than the governor's
+// neighbor_cap boids: every cell gets an equal share of the cap, and the
+// sums of a cell cut short are scaled up to its full size. Slots within a
+// cell are in no spatial order, so unlike cutting the run short this does
+// not favour its first (western) cell.
+ALWAYS_INLINE void capped_run(int first, int last, float px, float py,
+                              void (*kernel)(int, int, float, float, NeighborSums *),
+                              NeighborSums *s) {
+    int share = (neighbor_cap + (last - first) - 1) / (last - first);
+    for (int c = first; c < last; ++c) {
+        int begin = cell_start[c], end = cell_start[c + 1];
+        if (end - begin <= share) {
+            kernel(begin, end, px, py, s);
+            continue;
+        }
+        NeighborSums part = { 0 };
+        kernel(begin, begin + share, px, py, &part);
+        add_scaled_sums(s, &part, (float)(end - begin) / share);
+    }
+}
+
+// Splits the three columns around column cx into contiguous runs, each
+// with the shift in x its query point gets, and returns their number
+ALWAYS_INLINE int neighbor_runs(int cx, int run_begin[3], int run_end[3], float run_shift[3]) {
+    int runs = 0;
+    for (int d = -1; d <= 1; ++d) {
+        int col = cx + d;
+        float shift = 0;
+        if (col < 0) {
+            col += grid_cols;
+            shift = grid_width;
+        } else if (col >= grid_cols) {
+            col -= grid_cols;
+            shift = -grid_width;
+        }
+        if (runs > 0 && run_shift[runs - 1] == shift && run_end[runs - 1] == col) {
+            run_end[runs - 1] = col + 1;
+        } else {
+            run_begin[runs] = col;
+            run_end[runs] = col + 1;
+            run_shift[runs] = shift;
+            runs++;
+        }
+    }
+    return runs;
+}
+
+// Runs kernel over the 3x3 block of cells around boid i, wrapping around the
+// window edges. Cells are stored row by row, so each row of the block is one
+// contiguous range of sorted slots, or two when it wraps. Wrapped cells are
+// scanned with the query point moved by a window width/height, which puts
+// their boids at their nearest image without any per-pair work.
+//
+// This is exact as long as the window is at least 2 * NEIGHBOR_RADIUS in
+// each direction; in smaller windows a neighbor can be seen twice.
+ALWAYS_INLINE void gather_neighbors(int i,
+                                    void (*kernel)(int, int, float, float, NeighborSums *),
+                                    NeighborSums *s) {
+    int cx = boid_cell[i] % grid_cols;
+    int cy = boid_cell[i] / grid_cols;
+    int run_begin[3], run_end[3];
+    float run_shift[3];
+    int runs = neighbor_runs(cx, run_begin, run_end, run_shift);
+
+    memset(s, 0, sizeof(*s));
+    for (int d = -1; d <= 1; ++d) {
+        int ny = cy + d;
+        float shift = 0;
+        if (ny < 0) {
+            ny += grid_rows;
+            shift = grid_height;
+        } else if (ny >= grid_rows) {
+            ny -= grid_rows;
+            shift = -grid_height;
+        }
+
+        int row = ny * grid_cols;
+        for (int r = 0; r < runs; ++r) {
+            int begin = cell_start[row + run_begin[r]];
+            int end = cell_start[row + run_end[r]];
+            float px = boids.x[i] + run_shift[r], py = boids.y[i] + shift;
+            if (neighbor_cap > 0 && end - begin > neighbor_cap) {
+                capped_run(row + run_begin[r], row + run_end[r], px, py, kernel, s);
+            } else {
+                kernel(begin, end, px, py, s);
+            }
+        }
+    }
+}
+
+// gather_neighbors over the --compact copy. The sums stay in vector lanes
+// across all nine cells and are reduced once per boid instead of once per
+// run. Under the governor's cap the capped runs go through gather_neighbors.
+ALWAYS_INLINE void gather_compact(int i, NeighborSums *s, int separation_only) {
+    if (neighbor_cap > 0) {
+        gather_neighbors(i, separation_only ? accumulate_separation_compact
+                                            : accumulate_neighbors_compact, s);
+        return;
+    }
+
+    int cx = boid_cell[i] % grid_cols;
+    int cy = boid_cell[i] / grid_cols;
+    int run_begin[3], run_end[3];
+    float run_shift[3];
+    int runs = neighbor_runs(cx, run_begin, run_end, run_shift);
+    uint16_t qx[3];
+    for (int r = 0; r < runs; ++r) {
+        qx[r] = compact_position(boids.x[i] + run_shift[r]);
+    }
+
+    CompactSums c;
+    memset(&c, 0, sizeof(c));
+    for (int d = -1; d <= 1; ++d) {
+        int ny = cy + d;
+        float shift = 0;
+        if (ny < 0) {
+            ny += grid_rows;
+            shift = grid_height;
+        } else if (ny >= grid_rows) {
+            ny -= grid_rows;
+            shift = -grid_height;
+        }
+
+        int row = ny * grid_cols;
+        uint16_t qy = compact_position(boids.y[i] + shift);
+        for (int r = 0; r < runs; ++r) {
+            compact_scan(cell_start[row + run_begin[r]], cell_start[row + run_end[r]],
+                         qx[r], qy, &c, separation_only);
+        }
+    }
+    memset(s, 0, sizeof(*s));
+    compact_reduce(&c, s);
+}
+
+// gather_neighbors for --lod. Cells up to lod_threshold boids are scanned
+// exactly. Denser cells add their aggregate to the alignment and cohesion
+// sums (minus boid i itself if it is in there), Barnes-Hut style, and are
+// only scanned, with the cheaper separation kernel, when they come within
+// the separation radius of boid i. That is usually about 4 of the 9 cells,
+// so in a dense flock each boid does a fraction of the exact work while
+// separation stays exact.
+ALWAYS_INLINE void gather_lod(int i, NeighborSums *s) {
+    int cx = boid_cell[i] % grid_cols;
+    int cy = boid_cell[i] / grid_cols;
+
+    memset(s, 0, sizeof(*s));
+    for (int dy = -1; dy <= 1; ++dy) {
+        int ny = cy + dy;
+        float shift_y = 0;
+        if (ny < 0) {
+            ny += grid_rows;
+            shift_y = grid_height;
+        } else if (ny >= grid_rows) {
+            ny -= grid_rows;
+            shift_y = -grid_height;
+        }
+
+        // A row that does not wrap and has no dense cell is scanned as one
+        // run, as in gather_neighbors
+        int row = ny * grid_cols;
+        if (cx > 0 && cx < grid_cols - 1) {
+            const int *start = &cell_start[row + cx - 1];
+            int densest = start[1] - start[0];
+            if (start[2] - start[1] > densest) densest = start[2] - start[1];
+            if (start[3] - start[2] > densest) densest = start[3] - start[2];
+            if (densest <= lod_threshold) {
+                accumulate_neighbors(start[0], start[3], boids.x[i], boids.y[i] + shift_y, s);
+                continue;
+            }
+        }
+
+        for (int dx = -1; dx <= 1; ++dx) {
+            int nx = cx + dx;
+            float shift_x = 0;
+            if (nx < 0) {
+                nx += grid_cols;
+                shift_x = grid_width;
+            } else if (nx >= grid_cols) {
+                nx -= grid_cols;
+                shift_x = -grid_width;
+            }
+
+            int c = row + nx;
+            int begin = cell_start[c], end = cell_start[c + 1];
+            float px = boids.x[i] + shift_x, py = boids.y[i] + shift_y;
+            int n = end - begin;
+            if (n <= lod_threshold) {
+                accumulate_neighbors(begin, end, px, py, s);
+                continue;
+            }
+
+            // The whole cell counts as n boids at its mean position when that
+            // is within range, like a single distant boid would
+            const CellMean *m = &cell_means[c];
+            float mdx = m->x - px, mdy = m->y - py;
+            int self = c == boid_cell[i];
+            if (self || mdx * mdx + mdy * mdy < NEIGHBOR_RADIUS * NEIGHBOR_RADIUS) {
+                s->sum_vx += m->vx * n - (self ? boids.vx[i] : 0);
+                s->sum_vy += m->vy * n - (self ? boids.vy[i] : 0);
+                s->sum_dx += mdx * n;
+                s->sum_dy += mdy * n;
+                s->count += n - self;
+            }
+
+            float x0 = grid_origin_x + nx / grid_inv_cell_w, y0 = ny / grid_inv_cell_h;
+            float gx = fmaxf(fmaxf(x0 - px, px - (x0 + 1 / grid_inv_cell_w)), 0);
+            float gy = fmaxf(fmaxf(y0 - py, py - (y0 + 1 / grid_inv_cell_h)), 0);
+            if (gx * gx + gy * gy < (NEIGHBOR_RADIUS / 2) * (NEIGHBOR_RADIUS / 2)) {
+                NeighborSums near = { 0 };
+                accumulate_separation(begin, end, px, py, &near);
+                s->avoid_x += near.avoid_x;
+                s->avoid_y += near.avoid_y;
+            }
+        }
+    }
+}
+
+void calculate_lissajous_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float a = 3, b = 2;
+    *x = width/2 + scale * sin(a * t);
+    *y = height/2 + scale * sin(b * t + PI/2);
+}
+
+void calculate_rose_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float k = 3;
+    float r = scale * sin(k * t);
+    *x = width/2 + r * cos(t);
+    *y = height/2 + r * sin(t);
+}
+
+void calculate_hypocycloid_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float R = scale;
+    float r = R/4;
+    float d = r;
+    
+    *x = width/2 + (R-r) * cos(t) + d * cos((R-r)*t/r);
+    *y = height/2 + (R-r) * sin(t) - d * sin((R-r)*t/r);
+}
+
+void calculate_butterfly_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float r = exp(cos(t)) - 2 * cos(4*t) + pow(sin(t/12), 5);
+    *x = width/2 + scale/2 * sin(t) * r;
+    *y = height/2 + scale/2 * cos(t) * r;
+}
+
+void calculate_maurer_rose_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height) * 1.5;
+    float n = 7;
+    float d = 71;
+    float k = t * d;
+    float r = scale * (0.8 + 0.2 * sin(n * k * PI/180));
+    *x = width/2 + r * cos(k * PI/180);
+    *y = height/2 + r * sin(k * PI/180);
+}
+
+void calculate_spirograph_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float R = scale * 0.8;
+    float r = R * 0.4;
+    float d = r * 0.8;
+    
+    *x = width/2 + (R-r) * cos(t) + d * cos((R-r) * t/r);
+    *y = height/2 + (R-r) * sin(t) - d * sin((R-r) * t/r);
+}
+
+void calculate_fermat_spiral_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float a = scale * 0.5;
+    float r = a * sqrt(t);
+    float angle = t * 5;
+    
+    *x = width/2 + r * cos(angle);
+    *y = height/2 + r * sin(angle);
+}
+
+void calculate_cardioid_position(float t, float *x, float *y, int width, int height) {
+    float scale = get_scale_factor(width, height);
+    float a = scale * 0.9;
+    float r = a * (1 + cos(t));
+    
+    *x = width/2 + r * cos(t);
+    *y = height/2 + r * sin(t);
+}
+
+// Under the governor the impulse is only recomputed every
+// separation_interval steps and reused in between. Returns the number of
+// neighbors looked at.
+ALWAYS_INLINE int apply_separation_force(int i, float weight) {
+    int count = 0;
+    if (sim_step % separation_interval == 0) {
+        NeighborSums s;
+        if (compact_state) {
+            gather_compact(i, &s, 1);
+        } else {
+            gather_neighbors(i, accumulate_separation, &s);
+        }
+        boids.sep_vx[i] = s.avoid_x * weight;
+        boids.sep_vy[i] = s.avoid_y * weight;
+        count = s.count;
+    }
+
+    boids.vx[i] += boids.sep_vx[i] * step_scale;
+    boids.vy[i] += boids.sep_vy[i] * step_scale;
+    return count;
+}
+
+typedef struct {
+    int width, height;
+} StepArgs;
+
+typedef void (*CurveFn)(float t, float *x, float *y, int width, int height);
+
+// Pattern modes: the curve and the period in t after which it repeats.
+// Periodic curves are looked up in a table sampled once per window size;
+// the others (period 0) are evaluated for every boid. Modes from --patterns
+// have no CurveFn; their tables are filled by their PatternProgram.
+typedef struct {
+    CurveFn position;
+    float period;
+} PatternDef;
+
+const PatternDef patterns[NUM_MODES] = {
+    [MODE_LISSAJOUS] = { calculate_lissajous_position, 2 * PI },
+    [MODE_ROSE] = { calculate_rose_position, 2 * PI },
+    [MODE_HYPOCYCLOID] = { calculate_hypocycloid_position, 2 * PI },
+    [MODE_BUTTERFLY] = { calculate_butterfly_position, 24 * PI },
+    [MODE_MAURER_ROSE] = { calculate_maurer_rose_position, 360.0 / 71 },
+    [MODE_SPIROGRAPH] = { calculate_spirograph_position, 4 * PI },
+    [MODE_FERMAT_SPIRAL] = { calculate_fermat_spiral_position, 0 },
+    [MODE_CARDIOID] = { calculate_cardioid_position, 2 * PI },
+};
+
+// One sampled period of a pattern, in window coordinates
+typedef struct {
+    int width, height;   // window size the samples were taken for
+    int size;            // samples per period; x/y hold size + 1 (wrapped)
+    float *x, *y;
+} PatternTable;
+
+PatternTable pattern_tables[MAX_MODES];
+
+// --patterns FILE adds pattern modes defined by expressions:
+//
+//   pattern heart
+//   period 2 * pi
+//   r = scale / 18
+//   x = width / 2 + r * 16 * sin(t) ^ 3
+//   y = height / 2 - r * (13 * cos(t) - 5 * cos(2 * t) - 2 * cos(3 * t) - cos(4 * t))
+//
+// Each "name = expression" line sets a variable the later lines can use; x
+// and y are the target at parameter t. Expressions can use t, width, height,
+// scale (as in the built-in curves), pi, e and phi, + - * / ^, parentheses
+// and sin cos tan sqrt abs exp log floor min max atan2 mod. period (2 * pi
+// if left out) must be a constant of at most 64 * pi. Blank lines and #
+// comments are skipped.
+//
+// A pattern compiles to bytecode for a stack machine whose every
+// instruction works on a batch of PATTERN_BATCH values of t. It only runs
+// when the pattern table is sampled, so per boid a loaded pattern costs the
+// same table lookup as a built-in one.
+#define PATTERN_BATCH 64
+#define PATTERN_STACK 16
+#define PATTERN_VARS 32
+#define PATTERN_CODE 512
+
+typedef enum {
+    OP_CONST, OP_LOAD, OP_STORE,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_NEG,
+    OP_SIN, OP_COS, OP_TAN, OP_SQRT, OP_ABS, OP_EXP, OP_LOG, OP_FLOOR,
+    OP_MIN, OP_MAX, OP_ATAN2, OP_MOD, NUM_PATTERN_OPS
+} PatternOpCode;
+
+// Values each instruction pops; all but OP_STORE push one
+static const int pattern_op_pops[NUM_PATTERN_OPS] = {
+    [OP_CONST] = 0, [OP_LOAD] = 0, [OP_STORE] = 1,
+    [OP_ADD] = 2, [OP_SUB] = 2, [OP_MUL] = 2, [OP_DIV] = 2, [OP_POW] = 2, [OP_NEG] = 1,
+    [OP_SIN] = 1, [OP_COS] = 1, [OP_TAN] = 1, [OP_SQRT] = 1, [OP_ABS] = 1, [OP_EXP] = 1,
+    [OP_LOG] = 1, [OP_FLOOR] = 1,
+    [OP_MIN] = 2, [OP_MAX] = 2, [OP_ATAN2] = 2, [OP_MOD] = 2,
+};
+
+typedef struct {
+    PatternOpCode op;
+    int var;        // OP_LOAD / OP_STORE
+    float value;    // OP_CONST
+} PatternOp;
+
+// Variables 0-3 are the inputs
+enum { VAR_T, VAR_WIDTH, VAR_HEIGHT, VAR_SCALE, NUM_INPUT_VARS };
+
+typedef struct {
+    char name[32];
+    PatternOp code[PATTERN_CODE];
+    int length;
+    char vars[PATTERN_VARS][32];
+    int num_vars;
+    int x, y;       // variables holding the result
+} PatternProgram;
+
+PatternProgram pattern_programs[MAX_PATTERN_FILE_MODES];
+PatternDef file_patterns[MAX_PATTERN_FILE_MODES];
+
+// The definition of any mode; folds to the table entry for a constant mode
+ALWAYS_INLINE const PatternDef *pattern_def(FlockingMode mode) {
+    return mode < NUM_MODES ? &patterns[mode] : &file_patterns[mode - NUM_MODES];
+}
+
+// Functions callable from a pattern file, with their argument count
+static const struct {
+    const char *name;
+    PatternOpCode op;
+    int args;
+} pattern_functions[] = {
+    { "sin", OP_SIN, 1 }, { "cos", OP_COS, 1 }, { "tan", OP_TAN, 1 },
+    { "sqrt", OP_SQRT, 1 }, { "abs", OP_ABS, 1 }, { "exp", OP_EXP, 1 },
+    { "log", OP_LOG, 1 }, { "floor", OP_FLOOR, 1 }, { "min", OP_MIN, 2 },
+    { "max", OP_MAX, 2 }, { "atan2", OP_ATAN2, 2 }, { "mod", OP_MOD, 2 },
+};
+
+// Recursive descent compiler state for one line
+typedef struct {
+    const char *p;
+    PatternProgram *prog;
+    int depth, max_depth;   // stack depth while emitting
+    const char *error;
+} PatternParser;
+
+void pattern_emit(PatternParser *ps, PatternOpCode op, int var, float value, int pushes) {
+    if (ps->prog->length >= PATTERN_CODE) {
+        ps->error = "pattern too long";
+        return;
+    }
+    ps->prog->code[ps->prog->length++] = (PatternOp){ op, var, value };
+    ps->depth += pushes;
+    if (ps->depth > ps->max_depth) ps->max_depth = ps->depth;
+}
+
+void pattern_skip_space(PatternParser *ps) {
+    while (*ps->p == ' ' || *ps->p == '\t') ps->p++;
+}
+
+// Reads an identifier into name (at most 31 characters); returns its length
+int pattern_name(PatternParser *ps, char *name) {
+    pattern_skip_space(ps);
+    int n = 0;
+    while (isalnum((unsigned char)ps->p[n]) || ps->p[n] == '_') n++;
+    if (n == 0 || isdigit((unsigned char)ps->p[0])) return 0;
+    if (n > 31) {
+        ps->error = "name too long";
+        return 0;
+    }
+    memcpy(name, ps->p, n);
+    name[n] = 0;
+    ps->p += n;
+    return n;
+}
+
+int pattern_find_var(const PatternProgram *prog, const char *name) {
+    for (int v = 0; v < prog->num_vars; ++v) {
+        if (strcmp(prog->vars[v], name) == 0) return v;
+    }
+    return -1;
+}
+
+void pattern_expr(PatternParser *ps);
+
+void pattern_primary(PatternParser *ps) {
+    pattern_skip_space(ps);
+    if (*ps->p == '(') {
+        ps->p++;
+        pattern_expr(ps);
+        pattern_skip_space(ps);
+        if (*ps->p != ')') ps->error = "missing ')'";
+        else ps->p++;
+        return;
+    }
+    if (isdigit((unsigned char)*ps->p) || *ps->p == '.') {
+        char *end;
+        float value = strtof(ps->p, &end);
+        ps->p = end;
+        pattern_emit(ps, OP_CONST, 0, value, 1);
+        return;
+    }
+
+    char name[32];
+    if (!pattern_name(ps, name)) {
+        if (!ps->error) ps->error = "expected a number, name or '('";
+        return;
+    }
+    pattern_skip_space(ps);
+    if (*ps->p == '(') {
+        ps->p++;
+        for (size_t f = 0; f < sizeof(pattern_functions) / sizeof(pattern_functions[0]); ++f) {
+            if (strcmp(name, pattern_functions[f].name) != 0) continue;
+            for (int a = 0; a < pattern_functions[f].args && !ps->error; ++a) {
+                if (a > 0) {
+                    pattern_skip_space(ps);
+                    if (*ps->p != ',') {
+                        ps->error = "missing argument";
+                        return;
+                    }
+                    ps->p++;
+                }
+                pattern_expr(ps);
+            }
+            pattern_skip_space(ps);
+            if (*ps->p != ')') {
+                ps->error = "missing ')'";
+                return;
+            }
+            ps->p++;
+            pattern_emit(ps, pattern_functions[f].op, 0, 0, 1 - pattern_functions[f].args);
+            return;
+        }
+        ps->error = "unknown function";
+        return;
+    }
+
+    if (strcmp(name, "pi") == 0) {
+        pattern_emit(ps, OP_CONST, 0, PI, 1);
+    } else if (strcmp(name, "e") == 0) {
+        pattern_emit(ps, OP_CONST, 0, E, 1);
+    } else if (strcmp(name, "phi") == 0) {
+        pattern_emit(ps, OP_CONST, 0, PHI, 1);
+    } else {
+        int v = pattern_find_var(ps->prog, name);
+        if (v < 0) ps->error = "unknown variable";
+        else pattern_emit(ps, OP_LOAD, v, 0, 1);
+    }
+}
+
+// ^ binds tighter than unary minus and is right associative
+void pattern_unary(PatternParser *ps);
+
+void pattern_power(PatternParser *ps) {
+    pattern_primary(ps);
+    pattern_skip_space(ps);
+    if (*ps->p == '^' && !ps->error) {
+        ps->p++;
+        pattern_unary(ps);
+        pattern_emit(ps, OP_POW, 0, 0, -1);
+    }
+}
+
+void pattern_unary(PatternParser *ps) {
+    pattern_skip_space(ps);
+    if (*ps->p == '-') {
+        ps->p++;
+        pattern_unary(ps);
+        pattern_emit(ps, OP_NEG, 0, 0, 0);
+    } else {
+        pattern_power(ps);
+    }
+}
+
+void pattern_term(PatternParser *ps) {
+    pattern_unary(ps);
+    for (;;) {
+        pattern_skip_space(ps);
+        char c = *ps->p;
+        if ((c != '*' && c != '/') || ps->error) return;
+        ps->p++;
+        pattern_unary(ps);
+        pattern_emit(ps, c == '*' ? OP_MUL : OP_DIV, 0, 0, -1);
+    }
+}
+
+void pattern_expr(PatternParser *ps) {
+    pattern_term(ps);
+    for (;;) {
+        pattern_skip_space(ps);
+        char c = *ps->p;
+        if ((c != '+' && c != '-') || ps->error) return;
+        ps->p++;
+        pattern_term(ps);
+        pattern_emit(ps, c == '+' ? OP_ADD : OP_SUB, 0, 0, -1);
+    }
+}
+
+// Checks that prog never pops more than its stack holds, never overflows
+// it, leaves it empty and only touches its own variables. Returns NULL if so.
+const char *verify_pattern_program(const PatternProgram *prog) {
+    int sp = 0;
+    for (int pc = 0; pc < prog->length; ++pc) {
+        const PatternOp *op = &prog->code[pc];
+        if (op->op < 0 || op->op >= NUM_PATTERN_OPS) return "bad instruction";
+        int pops = pattern_op_pops[op->op];
+        if (sp < pops) return "stack underflow";
+        sp += (op->op == OP_STORE ? 0 : 1) - pops;
+        if (sp > PATTERN_STACK) return "expression too deep";
+        if ((op->op == OP_LOAD || op->op == OP_STORE) &&
+            (op->var < 0 || op->var >= prog->num_vars)) return "bad variable";
+    }
+    return sp == 0 ? NULL : "values left on the stack";
+}
+
+// Runs prog over n <= PATTERN_BATCH lanes of vars. Every instruction is one
+// loop over the batch, so the dispatch is paid once per batch. prog must
+// have passed verify_pattern_program.
+void run_pattern_program(const PatternProgram *prog, float vars[][PATTERN_BATCH], int n) {
+    float stack[PATTERN_STACK][PATTERN_BATCH];
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->length; ++pc) {
+        const PatternOp *op = &prog->code[pc];
+        int pops = pattern_op_pops[op->op];
+        assert(sp >= pops && sp - pops < PATTERN_STACK);
+        // a is the first operand and where the result goes, b the second
+        float *a = stack[sp - pops], *b = pops == 2 ? stack[sp - 1] : a;
+        switch (op->op) {
+            case OP_CONST: for (int l = 0; l < n; ++l) a[l] = op->value; break;
+            case OP_LOAD: memcpy(a, vars[op->var], n * sizeof(float)); break;
+            case OP_STORE: memcpy(vars[op->var], a, n * sizeof(float)); break;
+            case OP_ADD: for (int l = 0; l < n; ++l) a[l] += b[l]; break;
+            case OP_SUB: for (int l = 0; l < n; ++l) a[l] -= b[l]; break;
+            case OP_MUL: for (int l = 0; l < n; ++l) a[l] *= b[l]; break;
+            case OP_DIV: for (int l = 0; l < n; ++l) a[l] /= b[l]; break;
+            case OP_POW: for (int l = 0; l < n; ++l) a[l] = powf(a[l], b[l]); break;
+            case OP_MIN: for (int l = 0; l < n; ++l) a[l] = fminf(a[l], b[l]); break;
+            case OP_MAX: for (int l = 0; l < n; ++l) a[l] = fmaxf(a[l], b[l]); break;
+            case OP_ATAN2: for (int l = 0; l < n; ++l) a[l] = atan2f(a[l], b[l]); break;
+            case OP_MOD: for (int l = 0; l < n; ++l) a[l] = fmodf(a[l], b[l]); break;
+            case OP_NEG: for (int l = 0; l < n; ++l) a[l] = -a[l]; break;
+            case OP_SIN: for (int l = 0; l < n; ++l) a[l] = sinf(a[l]); break;
+            case OP_COS: for (int l = 0; l < n; ++l) a[l] = cosf(a[l]); break;
+            case OP_TAN: for (int l = 0; l < n; ++l) a[l] = tanf(a[l]); break;
+            case OP_SQRT: for (int l = 0; l < n; ++l) a[l] = sqrtf(a[l]); break;
+            case OP_ABS: for (int l = 0; l < n; ++l) a[l] = fabsf(a[l]); break;
+            case OP_EXP: for (int l = 0; l < n; ++l) a[l] = expf(a[l]); break;
+            case OP_LOG: for (int l = 0; l < n; ++l) a[l] = logf(a[l]); break;
+            case OP_FLOOR: for (int l = 0; l < n; ++l) a[l] = floorf(a[l]); break;
+            case NUM_PATTERN_OPS: break;
+        }
+        sp += (op->op == OP_STORE ? 0 : 1) - pops;
+    }
+}
+
+// Empties prog down to its input variables
+void init_pattern_program(PatternProgram *prog) {
+    static const char *inputs[NUM_INPUT_VARS] = { "t", "width", "height", "scale" };
+    memset(prog, 0, sizeof(*prog));
+    for (int v = 0; v < NUM_INPUT_VARS; ++v) strcpy(prog->vars[v], inputs[v]);
+    prog->num_vars = NUM_INPUT_VARS;
+}
+
+// Checks and stores the pattern being read when its block ends
+int finish_pattern(const char *path, int line, PatternProgram *prog, float period) {
+    prog->x = pattern_find_var(prog, "x");
+    prog->y = pattern_find_var(prog, "y");
+    if (prog->x < 0 || prog->y < 0) {
+        fprintf(stderr, "boids: %s:%d: pattern '%s' does not set both x and y\n",
+                path, line, prog->name);
+        return 1;
+    }
+    const char *error = verify_pattern_program(prog);
+    if (error) {
+        fprintf(stderr, "boids: %s:%d: pattern '%s': %s\n", path, line, prog->name, error);
+        return 1;
+    }
+    int m = num_modes++;
+    file_patterns[m - NUM_MODES] = (PatternDef){ NULL, period };
+    mode_names[m] = prog->name;
+    return 0;
+}
+
+int load_patterns(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    char text[512];
+    int line = 0;
+    PatternProgram *prog = NULL;
+    float period = 2 * PI;
+    const char *error = NULL;
+
+    while (!error && fgets(text, sizeof(text), f)) {
+        line++;
+        text[strcspn(text, "#\r\n")] = 0;
+        PatternParser ps = { text, prog, 0, 0, NULL };
+        char word[32];
+        pattern_skip_space(&ps);
+        if (!*ps.p) continue;
+        if (!pattern_name(&ps, word)) {
+            error = ps.error ? ps.error : "expected a name";
+            break;
+        }
+
+        if (strcmp(word, "pattern") == 0) {
+            if (prog && finish_pattern(path, line, prog, period) != 0) {
+                fclose(f);
+                return 1;
+            }
+            if (num_modes == MAX_MODES) {
+                error = "too many patterns";
+                break;
+            }
+            char name[32];
+            if (!pattern_name(&ps, name)) {
+                error = ps.error ? ps.error : "expected a pattern name";
+                break;
+            }
+            if (parse_mode(name) >= 0) {
+                error = "a mode with that name exists already";
+                break;
+            }
+            prog = &pattern_programs[num_modes - NUM_MODES];
+            init_pattern_program(prog);
+            strcpy(prog->name, name);
+            period = 2 * PI;
+            continue;
+        }
+        if (!prog) {
+            error = "expected 'pattern NAME' first";
+            break;
+        }
+
+        if (strcmp(word, "period") == 0) {
+            // Compiled on its own and run once, so it may not use variables
+            PatternProgram constant;
+            init_pattern_program(&constant);
+            ps.prog = &constant;
+            pattern_expr(&ps);
+            pattern_skip_space(&ps);
+            pattern_emit(&ps, OP_STORE, VAR_T, 0, -1);
+            for (int pc = 0; pc < constant.length && !ps.error; ++pc) {
+                if (constant.code[pc].op == OP_LOAD) ps.error = "period must be a constant";
+            }
+            if (!ps.error && *ps.p) ps.error = "unexpected text after the expression";
+            if (!ps.error && ps.max_depth > PATTERN_STACK) ps.error = "expression too deep";
+            if (!ps.error) ps.error = verify_pattern_program(&constant);
+            if (!ps.error) {
+                float vars[NUM_INPUT_VARS][PATTERN_BATCH];
+                run_pattern_program(&constant, vars, 1);
+                period = vars[VAR_T][0];
+                if (!(period > 0)) ps.error = "period must be positive";
+                else if (period > (float)PATTERN_MAX_PERIOD) ps.error = "period must be at most 64 * pi";
+            }
+            error = ps.error;
+            continue;
+        }
+
+        pattern_skip_space(&ps);
+        if (*ps.p != '=') {
+            error = "expected '='";
+            break;
+        }
+        ps.p++;
+        int v = pattern_find_var(prog, word);
+        if (v >= 0 && v < NUM_INPUT_VARS) {
+            error = "cannot assign an input";
+            break;
+        }
+        pattern_expr(&ps);
+        pattern_skip_space(&ps);
+        if (!ps.error && *ps.p) ps.error = "unexpected text after the expression";
+        if (!ps.error && ps.max_depth > PATTERN_STACK) ps.error = "expression too deep";
+        if (!ps.error && v < 0) {
+            if (prog->num_vars == PATTERN_VARS) ps.error = "too many variables";
+            else strcpy(prog->vars[v = prog->num_vars++], word);
+        }
+        if (!ps.error) pattern_emit(&ps, OP_STORE, v, 0, -1);
+        error = ps.error;
+    }
+    fclose(f);
+
+    if (error) {
+        fprintf(stderr, "boids: %s:%d: %s\n", path, line, error);
+        return 1;
+    }
+    if (!prog) {
+        fprintf(stderr, "boids: %s defines no pattern\n", path);
+        return 1;
+    }
+    return finish_pattern(path, line, prog, period);
+}
+
+// Fills a table from a loaded pattern, a batch of samples at a time
+void sample_pattern_program(const PatternProgram *prog, float period, PatternTable *table,
+                            int width, int height) {
+    float vars[PATTERN_VARS][PATTERN_BATCH];
+    float scale = get_scale_factor(width, height);
+    for (int k = 0; k <= table->size; k += PATTERN_BATCH) {
+        int n = table->size + 1 - k < PATTERN_BATCH ? table->size + 1 - k : PATTERN_BATCH;
+        for (int l = 0; l < n; ++l) {
+            vars[VAR_T][l] = period * (k + l) / table->size;
+            vars[VAR_WIDTH][l] = width;
+            vars[VAR_HEIGHT][l] = height;
+            vars[VAR_SCALE][l] = scale;
+        }
+        run_pattern_program(prog, vars, n);
+        memcpy(&table->x[k], vars[prog->x], n * sizeof(float));
+        memcpy(&table->y[k], vars[prog->y], n * sizeof(float));
+    }
+}
+
+// Samples the mode's curve if its table is missing or was built for another
+// window size
+void prepare_pattern_table(FlockingMode mode, int width, int height) {
+    const PatternDef *def = pattern_def(mode);
+    PatternTable *table = &pattern_tables[mode];
+    if (def->period <= 0) return;
+    if (table->x && table->width == width && table->height == height) return;
+
+    double samples = def->period / (2 * PI) * PATTERN_TABLE_DENSITY;
+    double max_samples = PATTERN_MAX_PERIOD / (2 * PI) * PATTERN_TABLE_DENSITY;
+    int size = (int)fmin(fmax(samples, PATTERN_TABLE_DENSITY), max_samples);
+    if (size != table->size || !table->x) {
+        free(table->x);
+        free(table->y);
+        table->x = malloc((size + 1) * sizeof(float));
+        table->y = malloc((size + 1) * sizeof(float));
+        if (!table->x || !table->y) {
+            fprintf(stderr, "boids: out of memory\n");
+            exit(1);
+        }
+        table->size = size;
+    }
+
+    if (mode >= NUM_MODES) {
+        sample_pattern_program(&pattern_programs[mode - NUM_MODES], def->period, table,
+                               width, height);
+    } else {
+        for (int k = 0; k <= size; ++k) {
+            def->position(def->period * k / size, &table->x[k], &table->y[k], width, height);
+        }
+    }
+    table->width = width;
+    table->height = height;
+}
+
+// Target of boid i in the given pattern mode. Called with a constant mode
+// from the kernels below, so the table-or-curve choice and the curve itself
+// are resolved at compile time.
+ALWAYS_INLINE void pattern_target(FlockingMode mode, int i, float time, int width, int height) {
+    const PatternDef *def = pattern_def(mode);
+    const PatternTable *table = &pattern_tables[mode];
+    float t = boids.index[i] * (10.0f / num_boids) + time;
+
+    if (def->period <= 0) {
+        def->position(t, &boids.target_x[i], &boids.target_y[i], width, height);
+        return;
+    }
+
+    float u = t * (1.0f / def->period);
+    u = (u - floorf(u)) * table->size;
+    int k = (int)u;
+    if (k >= table->size) k = table->size - 1;
+    float frac = u - k;
+    boids.target_x[i] = table->x[k] + (table->x[k + 1] - table->x[k]) * frac;
+    boids.target_y[i] = table->y[k] + (table->y[k + 1] - table->y[k]) * frac;
+}
+
+// Accelerates boid i towards its pattern target, weight times the full force
+ALWAYS_INLINE void steer_to_target(int i, float weight) {
+    float target_x = boids.target_x[i];
+    float target_y = boids.target_y[i];
+
+    float dx = target_x - boids.x[i];
+    float dy = target_y - boids.y[i];
+    float dist = sqrtf(dx * dx + dy * dy);
+    
+    if (dist > 0) {
+        boids.vx[i] += (dx / dist) * PATTERN_FORCE * weight * step_scale;
+        boids.vy[i] += (dy / dist) * PATTERN_FORCE * weight * step_scale;
+    }
+}
+
+// Steers boid i towards its pattern target. Returns the number of neighbors
+// the separation force looked at.
+ALWAYS_INLINE int apply_pattern_force(int i) {
+    steer_to_target(i, 1);
+    return apply_separation_force(i, PATTERN_SEPARATION_WEIGHT);
+}
+
+FlockingMode get_next_pattern_mode() {
+    FlockingMode next_mode;
+    do {
+        next_mode = random_below(num_modes - 1) + 1;
+    } while (next_mode == last_pattern_mode);
+    last_pattern_mode = next_mode;
+    return next_mode;
+}
+
+void check_auto_mode_timing() {
+    // Networked nodes follow the mode of node 0
+    if (!auto_mode || net.node > 0) return;
+    
+    time_t current_time = time(NULL);
+    int elapsed = current_time - last_mode_change;
+    
+    if (current_mode == MODE_NORMAL && elapsed >= BOIDS_TIME) {
+        set_mode(get_next_pattern_mode());
+        last_mode_change = current_time;
+    }
+    else if (current_mode != MODE_NORMAL && elapsed >= PATTERN_TIME) {
+        set_mode(MODE_NORMAL);
+        last_mode_change = current_time;
+    }
+}
+
+void run_job_chunks(void) {
+    for (;;) {
+        int begin = __atomic_fetch_add(&pool_next, pool_chunk, __ATOMIC_RELAXED);
+        if (begin >= pool_items) break;
+        int end = begin + pool_chunk < pool_items ? begin + pool_chunk : pool_items;
+        pool_job(begin, end, pool_arg);
+    }
+}
+
+void *worker_main(void *unused) {
+    (void)unused;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (pool_generation == seen) {
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        }
+        seen = pool_generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_job_chunks();
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_busy == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    return NULL;
+}
+
+void start_workers(int threads) {
+    num_threads = threads < 1 ? 1 : threads;
+    workers = malloc(num_threads * sizeof(pthread_t));
+    for (int t = 1; t < num_threads; ++t) {
+        if (pthread_create(&workers[t], NULL, worker_main, NULL) != 0) {
+            fprintf(stderr, "boids: could not start worker thread, using %d\n", t);
+            num_threads = t;
+            break;
+        }
+    }
+}
+
+// Calls job over [0, items) in ranges of chunk items spread over the pool.
+// Returns once every range is done.
+void run_parallel_chunked(RangeJob job, int items, int chunk, void *arg) {
+    if (num_threads <= 1 || items <= chunk) {
+        job(0, items, arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_job = job;
+    pool_arg = arg;
+    pool_items = items;
+    pool_next = 0;
+    pool_chunk = chunk;
+    pool_busy = num_threads - 1;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_job_chunks();
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_busy > 0) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Calls job over [0, items) split into chunks, using the worker pool when
+// there is enough work
+void run_parallel(RangeJob job, int items, void *arg) {
+    if (items < PARALLEL_MIN_ITEMS) {
+        job(0, items, arg);
+        return;
+    }
+    run_parallel_chunked(job, items, PARALLEL_CHUNK, arg);
+}
+
+void set_tiles(int cols, int rows) {
+    tile_cols = cols;
+    tile_rows = rows;
+    num_tiles = cols * rows;
+    tiles = calloc(num_tiles, sizeof(Tile));
+    if (!tiles) {
+        fprintf(stderr, "boids: out of memory\n");
+        exit(1);
+    }
+}
+
+void add_ghost(int tx, int ty, int i) {
+    tx = (tx + tile_cols) % tile_cols;
+    ty = (ty + tile_rows) % tile_rows;
+    int t = ty * tile_cols + tx;
+    if (t == boid_tile[i]) return;
+
+    Tile *tile = &tiles[t];
+    // With two tiles across, left and right are the same neighbor
+    if (tile->num_ghosts > 0 && tile->ghosts[tile->num_ghosts - 1] == i) return;
+    if (tile->num_ghosts == tile->ghost_capacity) {
+        tile->ghost_capacity = tile->ghost_capacity ? tile->ghost_capacity * 2 : 256;
+        tile->ghosts = realloc(tile->ghosts, tile->ghost_capacity * sizeof(int));
+        if (!tile->ghosts) {
+            fprintf(stderr, "boids: out of memory\n");
+            exit(1);
+        }
+    }
+    tile->ghosts[tile->num_ghosts++] = i;
+}
+
+// Moves every boid into the slot range of the tile it is in now (a stable
+// counting sort, skipped when no boid changed tile)
+void partition_flock(int width, int height) {
+    for (int t = 0; t < num_tiles; ++t) {
+        Tile *tile = &tiles[t];
+        int tx = t % tile_cols, ty = t / tile_cols;
+        tile->x = tx * width / tile_cols;
+        tile->y = ty * height / tile_rows;
+        tile->width = (tx + 1) * width / tile_cols - tile->x;
+        tile->height = (ty + 1) * height / tile_rows - tile->y;
+        tile->begin = tile->end = 0;
+    }
+
+    int sorted = 1;
+    for (int i = 0; i < num_boids; ++i) {
+        int tx = (int)(boids.x[i] * tile_cols / width);
+        int ty = (int)(boids.y[i] * tile_rows / height);
+        if (tx >= tile_cols) tx = tile_cols - 1;
+        if (ty >= tile_rows) ty = tile_rows - 1;
+        boid_tile[i] = ty * tile_cols + tx;
+        tiles[boid_tile[i]].end++;
+        if (i > 0 && boid_tile[i] < boid_tile[i - 1]) sorted = 0;
+    }
+
+    int offset = 0;
+    for (int t = 0; t < num_tiles; ++t) {
+        tiles[t].begin = offset;
+        offset += tiles[t].end;
+        tiles[t].end = tiles[t].begin;
+    }
+    for (int i = 0; i < num_boids; ++i) {
+        migrate_order[tiles[boid_tile[i]].end++] = i;
+    }
+
+    if (!sorted) permute_flock(migrate_order);
+
+    for (int t = 0; t < num_tiles; ++t) {
+        for (int i = tiles[t].begin; i < tiles[t].end; ++i) {
+            boid_tile[i] = t;
+        }
+    }
+}
+
+// Rebuilds the ghost lists from the view about to be drawn
+void find_ghosts(void) {
+    for (int t = 0; t < num_tiles; ++t) {
+        tiles[t].num_ghosts = 0;
+    }
+    for (int t = 0; t < num_tiles; ++t) {
+        Tile *tile = &tiles[t];
+        int tx = t % tile_cols, ty = t / tile_cols;
+        int end = tile->end < view.count ? tile->end : view.count;
+        for (int i = tile->begin; i < end; ++i) {
+            int left = view.x[i] - tile->x < TILE_HALO;
+            int right = tile->x + tile->width - view.x[i] <= TILE_HALO;
+            int top = view.y[i] - tile->y < TILE_HALO;
+            int bottom = tile->y + tile->height - view.y[i] <= TILE_HALO;
+            int dx = left ? -1 : right ? 1 : 0;
+            int dy = top ? -1 : bottom ? 1 : 0;
+            if (dx) add_ghost(tx + dx, ty, i);
+            if (dy) add_ghost(tx, ty + dy, i);
+            if (dx && dy) add_ghost(tx + dx, ty + dy, i);
+        }
+    }
+}
+
+typedef struct {
+    RangeJob job;
+    void *arg;
+} TileJob;
+
+void tile_job(int begin, int end, void *arg) {
+    TileJob *tj = arg;
+    for (int t = begin; t < end; ++t) {
+        tj->job(tiles[t].begin, tiles[t].end, tj->arg);
+    }
+}
+
+// Runs a per-boid job over the whole flock: one pool item per tile in tiled
+// mode, chunks of boids otherwise
+void run_flock(RangeJob job, void *arg) {
+    if (num_tiles <= 1) {
+        run_parallel(job, num_boids, arg);
+        return;
+    }
+    TileJob tj = { job, arg };
+    run_parallel_chunked(tile_job, num_tiles, 1, &tj);
+}
+
+// Whole-array force kernels, one per mode. update_boids picks the kernel once
+// per step, so there is no mode dispatch inside the loops.
+//
+// Neighbor state is only read from the grid's sorted copy (the previous
+// state) and each boid only writes its own slot, so ranges can run on any
+// thread in any order with the same result.
+// Applies weight times the flocking forces the sums call for
+ALWAYS_INLINE void apply_flocking_force(int i, const NeighborSums *s, float weight) {
+    if (s->count > 0) {
+        float avg_vx = s->sum_vx / s->count;
+        float avg_vy = s->sum_vy / s->count;
+        float center_dx = s->sum_dx / s->count;
+        float center_dy = s->sum_dy / s->count;
+        float scale = weight * step_scale;
+
+        boids.vx[i] += (avg_vx - boids.vx[i]) * ALIGNMENT_WEIGHT * scale;
+        boids.vy[i] += (avg_vy - boids.vy[i]) * ALIGNMENT_WEIGHT * scale;
+        boids.vx[i] += center_dx * COHESION_WEIGHT * scale;
+        boids.vy[i] += center_dy * COHESION_WEIGHT * scale;
+        boids.vx[i] += s->avoid_x * SEPARATION_WEIGHT * scale;
+        boids.vy[i] += s->avoid_y * SEPARATION_WEIGHT * scale;
+    }
+}
+
+// The flocking sums of boid i from the neighbor search in use
+ALWAYS_INLINE void flock_sums(int i, NeighborSums *s) {
+    if (compact_state) {
+        gather_compact(i, s, 0);
+    } else {
+        gather_neighbors(i, accumulate_neighbors, s);
+    }
+}
+
+void flock_kernel(int begin, int end, void *arg) {
+    (void)arg;
+    long neighbors = 0;
+    for (int i = begin; i < end; ++i) {
+        NeighborSums s;
+        flock_sums(i, &s);
+        neighbors += s.count;
+        apply_flocking_force(i, &s, 1);
+    }
+    __atomic_fetch_add(&step_neighbors, neighbors, __ATOMIC_RELAXED);
+}
+
+// MODE_NORMAL with --lod
+void flock_lod_kernel(int begin, int end, void *arg) {
+    (void)arg;
+    long neighbors = 0;
+    for (int i = begin; i < end; ++i) {
+        NeighborSums s;
+        gather_lod(i, &s);
+        neighbors += s.count;
+        apply_flocking_force(i, &s, 1);
+    }
+    __atomic_fetch_add(&step_neighbors, neighbors, __ATOMIC_RELAXED);
+}
+
+// Pattern kernels: compute the target for the mode, steer towards it and
+// apply separation, all with the mode fixed at compile time
+#define PATTERN_KERNEL(name, mode)                                      \
+    void name(int begin, int end, void *arg) {                          \
+        StepArgs *args = arg;                                           \
+        long neighbors = 0;                                             \
+        for (int i = begin; i < end; ++i) {                             \
+            pattern_target(mode, i, pattern_time, args->width, args->height); \
+            neighbors += apply_pattern_force(i);                        \
+        }                                                               \
+        __atomic_fetch_add(&step_neighbors, neighbors, __ATOMIC_RELAXED); \
+    }
+
+PATTERN_KERNEL(lissajous_kernel, MODE_LISSAJOUS)
+PATTERN_KERNEL(rose_kernel, MODE_ROSE)
+PATTERN_KERNEL(hypocycloid_kernel, MODE_HYPOCYCLOID)
+PATTERN_KERNEL(butterfly_kernel, MODE_BUTTERFLY)
+PATTERN_KERNEL(maurer_rose_kernel, MODE_MAURER_ROSE)
+PATTERN_KERNEL(spirograph_kernel, MODE_SPIROGRAPH)
+PATTERN_KERNEL(fermat_spiral_kernel, MODE_FERMAT_SPIRAL)
+PATTERN_KERNEL(cardioid_kernel, MODE_CARDIOID)
+// Modes from --patterns share one kernel; they all go through their table
+PATTERN_KERNEL(file_pattern_kernel, current_mode)
+
+// Kernel while a transition runs: every mode's forces, each scaled by its
+// share of the blend. It runs one neighbor search per boid, the flocking
+// one if any of the modes flocks (its sums also give the patterns'
+// separation) and the separation one otherwise, so a transition step costs
+// about what a step of a single mode does, plus a target per pattern.
+void transition_kernel(int begin, int end, void *arg) {
+    StepArgs *args = arg;
+    float blend = transition_blend(transition_progress);
+    FlockingMode modes[MAX_FADING_MODES + 1];
+    float weights[MAX_FADING_MODES + 1], times[MAX_FADING_MODES + 1];
+    int n = 0;
+    for (int k = 0; k < num_fading; ++k, ++n) {
+        modes[n] = fading[k].mode;
+        weights[n] = fading[k].weight * (1 - blend);
+        times[n] = fading[k].time;
+    }
+    modes[n] = current_mode;
+    weights[n] = blend;
+    times[n++] = pattern_time;
+    float flock_weight = 0;
+    for (int m = 0; m < n; ++m) {
+        if (modes[m] == MODE_NORMAL) flock_weight += weights[m];
+    }
+    long neighbors = 0;
+
+    for (int i = begin; i < end; ++i) {
+        if (flock_weight > 0) {
+            NeighborSums s;
+            if (lod_threshold > 0) {
+                gather_lod(i, &s);
+            } else {
+                flock_sums(i, &s);
+            }
+            neighbors += s.count;
+            apply_flocking_force(i, &s, flock_weight);
+            float sep = PATTERN_SEPARATION_WEIGHT * (1 - flock_weight) * step_scale;
+            boids.vx[i] += s.avoid_x * sep;
+            boids.vy[i] += s.avoid_y * sep;
+        } else {
+            neighbors += apply_separation_force(i, PATTERN_SEPARATION_WEIGHT);
+        }
+        // The new mode goes last, so target_x/y end up holding its target
+        for (int m = 0; m < n; ++m) {
+            if (modes[m] == MODE_NORMAL) continue;
+            pattern_target(modes[m], i, times[m], args->width, args->height);
+            steer_to_target(i, weights[m]);
+        }
+    }
+    __atomic_fetch_add(&step_neighbors, neighbors, __ATOMIC_RELAXED);
+}
+
+const RangeJob mode_kernels[NUM_MODES] = {
+    [MODE_NORMAL] = flock_kernel,
+    [MODE_LISSAJOUS] = lissajous_kernel,
+    [MODE_ROSE] = rose_kernel,
+    [MODE_HYPOCYCLOID] = hypocycloid_kernel,
+    [MODE_BUTTERFLY] = butterfly_kernel,
+    [MODE_MAURER_ROSE] = maurer_rose_kernel,
+    [MODE_SPIROGRAPH] = spirograph_kernel,
+    [MODE_FERMAT_SPIRAL] = fermat_spiral_kernel,
+    [MODE_CARDIOID] = cardioid_kernel,
+};
+
+void integrate_range(int begin, int end, void *arg) {
+    StepArgs *args = arg;
+    int width = args->width;
+    int height = args->height;
+
+    for (int i = begin; i < end; ++i) {
+        limit_speed(i);
+
+        boids.x[i] += boids.vx[i] * step_scale;
+        boids.y[i] += boids.vy[i] * step_scale;
+
+        // Under --net, boids leaving sideways are handed on by net_migrate
+        if (net.count == 0) {
+            if (boids.x[i] < 0) boids.x[i] += width;
+            if (boids.x[i] >= width) boids.x[i] -= width;
+        }
+        if (boids.y[i] < 0) boids.y[i] += height;
+        if (boids.y[i] >= height) boids.y[i] -= height;
+    }
+}
+
+void update_boids(int width, int height) {
+    double t0 = now_seconds();
+
+    if (net.count > 0) net_exchange(width, height);
+    if (num_tiles > 1) partition_flock(width, height);
+
+    // Shared by the flocking loop and the pattern separation force. It also
+    // holds the read copy of the state for this step.
+    build_grid(width, height);
+    double t1 = now_seconds();
+    int transition = transition_progress < 1;
+
+    StepArgs args = { width, height };
+    step_neighbors = 0;
+    if (current_mode != MODE_NORMAL) {
+        prepare_pattern_table(current_mode, width, height);
+    }
+    for (int k = 0; k < num_fading && transition; ++k) {
+        if (fading[k].mode != MODE_NORMAL) prepare_pattern_table(fading[k].mode, width, height);
+    }
+    RangeJob kernel = current_mode < NUM_MODES ? mode_kernels[current_mode] :
+                      file_pattern_kernel;
+    if (current_mode == MODE_NORMAL && lod_threshold > 0) kernel = flock_lod_kernel;
+    if (transition) kernel = transition_kernel;
+    run_flock(kernel, &args);
+    double t2 = now_seconds();
+
+    run_flock(integrate_range, &args);
+    if (net.count > 0) net_migrate(width, height);
+    double t3 = now_seconds();
+
+    step_timing.grid = t1 - t0;
+    step_timing.forces = t2 - t1;
+    step_timing.integrate = t3 - t2;
+
+    if (current_mode != MODE_NORMAL) {
+        pattern_time += 0.01 * step_scale;
+    }
+    if (transition) {
+        for (int k = 0; k < num_fading; ++k) {
+            if (fading[k].mode != MODE_NORMAL) fading[k].time += 0.01 * step_scale;
+        }
+        transition_progress += SIM_DT * step_scale / transition_seconds;
+        if (transition_progress >= 1) {
+            transition_progress = 1;
+            num_fading = 0;
+        }
+    }
+    sim_step++;
+}
+
+// Applies a governor level: 0 is full quality, every level above trades a
+// bit more accuracy for time, ending with half-rate simulation
+void set_quality_level(int level) {
+    static const int caps[] = { 0, 48, 24, 24 };
+    static const int intervals[] = { 1, 2, 4, 4 };
+
+    governor.level = level;
+    neighbor_cap = caps[level];
+    separation_interval = intervals[level];
+    step_scale = level >= 3 ? 2 : 1;
+}
+
+// Feeds one frame's simulate + render cost to the governor
+void governor_update(double frame_cost) {
+    if (governor.budget <= 0) return;
+
+    governor.cost += (frame_cost - governor.cost) * GOVERNOR_SMOOTHING;
+    if (governor.hold > 0) {
+        governor.hold--;
+        return;
+    }
+
+    if (governor.cost > governor.budget && governor.level < GOVERNOR_MAX_LEVEL) {
+        set_quality_level(governor.level + 1);
+        governor.hold = GOVERNOR_HOLD_FRAMES;
+    } else if (governor.cost < governor.budget * GOVERNOR_RECOVER && governor.level > 0) {
+        set_quality_level(governor.level - 1);
+        governor.hold = GOVERNOR_HOLD_FRAMES;
+    }
+}
+
+void save_previous_positions(void) {
+    memcpy(boids.prev_x, boids.x, num_boids * sizeof(float));
+    memcpy(boids.prev_y, boids.y, num_boids * sizeof(float));
+}
+
+typedef struct {
+    float *x, *y;
+    float alpha;
+    int width, height;
+} InterpolateArgs;
+
+void interpolate_range(int begin, int end, void *arg) {
+    InterpolateArgs *args = arg;
+    float alpha = args->alpha;
+
+    for (int i = begin; i < end; ++i) {
+        float dx = boids.x[i] - boids.prev_x[i];
+        float dy = boids.y[i] - boids.prev_y[i];
+        // A jump of more than half the window means the boid wrapped around
+        if (fabsf(dx) > args->width / 2 || fabsf(dy) > args->height / 2) {
+            args->x[i] = boids.x[i];
+            args->y[i] = boids.y[i];
+        } else {
+            args->x[i] = boids.prev_x[i] + dx * alpha;
+            args->y[i] = boids.prev_y[i] + dy * alpha;
+        }
+    }
+}
+
+// Fills x/y with positions alpha of the way through the last step
+void interpolate_positions(float *x, float *y, float alpha, int width, int height) {
+    InterpolateArgs args = { x, y, alpha, width, height };
+    run_parallel(interpolate_range, num_boids, &args);
+}
+
+// Sleeps until the absolute deadline, then moves it one period forward. If
+// the frame overran by more than a whole period the schedule restarts from
+// now rather than rushing to catch up. Returns 1 if the deadline was missed.
+int wait_for_deadline(struct timespec *deadline, long period_ns) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int missed = now.tv_sec > deadline->tv_sec ||
+                 (now.tv_sec == deadline->tv_sec && now.tv_nsec > deadline->tv_nsec);
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline->tv_nsec += period_ns;
+    while (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        deadline->tv_sec++;
+    }
+    long behind = (now.tv_sec - deadline->tv_sec) * 1000000000L + (now.tv_nsec - deadline->tv_nsec);
+    if (behind > 0) {
+        *deadline = now;
+    }
+    return missed;
+}
+
+// Turns the totals in frame_stats into the HUD text and a --stats-file row
+// once every STATS_PERIOD seconds, then starts a new period
+void report_frame_stats(double now) {
+    FrameStats *st = &frame_stats;
+    double elapsed = now - st->start;
+    if (elapsed < STATS_PERIOD || st->frames == 0) return;
+
+    double ms[NUM_PHASES];
+    double total = 0;
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        ms[p] = st->phase[p] / st->frames * 1e3;
+        total += ms[p];
+    }
+    double neighbors = st->boid_steps > 0 ? st->neighbors / st->boid_steps : 0;
+
+    snprintf(hud_lines[0], sizeof(hud_lines[0]), "%.1f fps  %d boids  %s  q%d",
+             st->frames / elapsed, view.count, mode_names[view.mode], view.level);
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        snprintf(hud_lines[1 + p], sizeof(hud_lines[0]), "%-10s %7.3f ms", phase_names[p], ms[p]);
+    }
+    snprintf(hud_lines[1 + NUM_PHASES], sizeof(hud_lines[0]), "%-10s %7.3f ms", "total", total);
+    snprintf(hud_lines[2 + NUM_PHASES], sizeof(hud_lines[0]), "%.1f neighbors/boid  %d missed",
+             neighbors, st->missed);
+
+    if (stats_file) {
+        fprintf(stats_file, "%.3f,%d,%.2f,%d,%d", now, view.count, st->frames / elapsed,
+                view.mode, view.level);
+        for (int p = 0; p < NUM_PHASES; ++p) {
+            fprintf(stats_file, ",%.4f", ms[p]);
+        }
+        fprintf(stats_file, ",%.2f,%d\n", neighbors, st->missed);
+        fflush(stats_file);
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->start = now;
+}
+
+void open_stats_file(const char *path) {
+    stats_file = fopen(path, "w");
+    if (!stats_file) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(stats_file, "time,boids,fps,mode,quality");
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        fprintf(stats_file, ",%s_ms", phase_names[p]);
+    }
+    fprintf(stats_file, ",neighbors_per_boid,missed\n");
+}
+
+// DPMS sends no events, so the monitor state is polled, at most once every
+// IDLE_POLL seconds since each query is a round trip
+int monitor_off(Display *display) {
+    static int have_dpms = -1;
+    static int off = 0;
+    static double last_check = 0;
+
+    if (have_dpms < 0) {
+        int event_base, error_base;
+        have_dpms = DPMSQueryExtension(display, &event_base, &error_base) && DPMSCapable(display);
+    }
+    if (!have_dpms) return 0;
+
+    double now = now_seconds();
+    if (now - last_check >= IDLE_POLL) {
+        CARD16 level;
+        BOOL enabled;
+        off = DPMSInfo(display, &level, &enabled) && enabled && level != DPMSModeOn;
+        last_check = now;
+    }
+    return off;
+}
+
+// Blocks until the X connection has input or timeout seconds pass
+void wait_for_x_events(Display *display, double timeout) {
+    XFlush(display);
+    if (XPending(display)) return;
+
+    int fd = ConnectionNumber(display);
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval tv = { (time_t)timeout, (suseconds_t)((timeout - (time_t)timeout) * 1e6) };
+    select(fd + 1, &fds, NULL, NULL, &tv);
+}
+
+void draw_hud(Display *display, Drawable d, GC gc) {
+    for (int l = 0; l < HUD_LINES; ++l) {
+        XDrawString(display, d, gc, 8, 8 + HUD_LINE_HEIGHT * (l + 1),
+                    hud_lines[l], strlen(hud_lines[l]));
+    }
+}
+
+// Grows segments/points to at least count entries
+void reserve_batches(int count) {
+    if (count <= batch_capacity) return;
+    batch_capacity = count + count / 2;
+    segments = realloc(segments, batch_capacity * sizeof(XSegment));
+    points = realloc(points, batch_capacity * sizeof(XPoint));
+    if (!segments || !points) {
+        fprintf(stderr, "boids: out of memory\n");
+        exit(1);
+    }
+}
+
+void draw_boids(Display *display, Drawable d, GC gc) {
+    // Keep every request under the server's limit: 3 header units, then two
+    // units per segment or one per point
+    long max_units = XMaxRequestSize(display) - 3;
+    reserve_batches(view.count);
+
+    switch (render_backend) {
+        case RENDER_LINES:
+            for (int i = 0; i < view.count; ++i) {
+                int x1 = (int)view.x[i];
+                int y1 = (int)view.y[i];
+                int x2 = x1 + (int)(view.vx[i] * 4);
+                int y2 = y1 + (int)(view.vy[i] * 4);
+                XDrawLine(display, d, gc, x1, y1, x2, y2);
+            }
+            break;
+        case RENDER_SEGMENTS: {
+            for (int i = 0; i < view.count; ++i) {
+                int x1 = (int)view.x[i];
+                int y1 = (int)view.y[i];
+                segments[i].x1 = x1;
+                segments[i].y1 = y1;
+                segments[i].x2 = x1 + (int)(view.vx[i] * 4);
+                segments[i].y2 = y1 + (int)(view.vy[i] * 4);
+            }
+            int chunk = (int)(max_units / 2);
+            for (int i = 0; i < view.count; i += chunk) {
+                int n = view.count - i < chunk ? view.count - i : chunk;
+                XDrawSegments(display, d, gc, &segments[i], n);
+            }
+            break;
+        }
+        case RENDER_POINTS: {
+            for (int i = 0; i < view.count; ++i) {
+                points[i].x = (int)view.x[i];
+                points[i].y = (int)view.y[i];
+            }
+            int chunk = (int)max_units;
+            for (int i = 0; i < view.count; i += chunk) {
+                int n = view.count - i < chunk ? view.count - i : chunk;
+                XDrawPoints(display, d, gc, &points[i], n, CoordModeOrigin);
+            }
+            break;
+        }
+        case RENDER_SHM:
+        case RENDER_GL:
+            // Drawn by rasterize_boids / gl_render
+            break;
+    }
+}
+
+// Draws one tile's own boids and its ghosts, clipped to the tile. Ghosts are
+// the boids of neighboring tiles whose lines may reach into this one.
+void draw_tile(Display *display, Drawable d, GC gc, Tile *tile) {
+    long max_units = XMaxRequestSize(display) - 3;
+    int end = tile->end < view.count ? tile->end : view.count;
+    int n = 0;
+    reserve_batches(view.count);
+
+    for (int k = tile->begin; k < end + tile->num_ghosts; ++k) {
+        int i = k < end ? k : tile->ghosts[k - end];
+        if (i >= view.count) continue;
+        int x1 = (int)view.x[i];
+        int y1 = (int)view.y[i];
+        if (render_backend == RENDER_POINTS) {
+            points[n].x = x1;
+            points[n].y = y1;
+        } else {
+            segments[n].x1 = x1;
+            segments[n].y1 = y1;
+            segments[n].x2 = x1 + (int)(view.vx[i] * 4);
+            segments[n].y2 = y1 + (int)(view.vy[i] * 4);
+        }
+        n++;
+    }
+
+    XRectangle clip = { tile->x, tile->y, tile->width, tile->height };
+    XSetClipRectangles(display, gc, 0, 0, &clip, 1, Unsorted);
+    if (render_backend == RENDER_POINTS) {
+        for (int i = 0; i < n; i += (int)max_units) {
+            int count = n - i < max_units ? n - i : (int)max_units;
+            XDrawPoints(display, d, gc, &points[i], count, CoordModeOrigin);
+        }
+    } else {
+        int chunk = (int)(max_units / 2);
+        for (int i = 0; i < n; i += chunk) {
+            XDrawSegments(display, d, gc, &segments[i], n - i < chunk ? n - i : chunk);
+        }
+    }
+    XSetClipMask(display, gc, None);
+}
+
+// MIT-SHM framebuffer. The image memory is shared with the server, so it
+// must not be touched while an XShmPutImage is still being read (pending).
+typedef struct {
+    XShmSegmentInfo info;
+    XImage *image;
+    int pending;
+    int completion_type;
+} ShmBuffer;
+
+ShmBuffer shm = { .image = NULL };
+int shm_attach_failed = 0;
+
+int shm_error_handler(Display *display, XErrorEvent *e) {
+    (void)display;
+    (void)e;
+    shm_attach_failed = 1;
+    return 0;
+}
+
+void shm_destroy(Display *display) {
+    if (!shm.image) return;
+    XShmDetach(display, &shm.info);
+    XDestroyImage(shm.image);
+    shmdt(shm.info.shmaddr);
+    shm.image = NULL;
+    shm.pending = 0;
+}
+
+// Creates the shared image for the window's visual. Only 32 bits per pixel
+// images are rasterized; anything else returns 0 so the caller can fall back
+// to the Pixmap path.
+int shm_create(Display *display, XWindowAttributes *attr, int width, int height) {
+    if (!XShmQueryExtension(display)) return 0;
+
+    shm.image = XShmCreateImage(display, attr->visual, attr->depth, ZPixmap,
+                                NULL, &shm.info, width, height);
+    if (!shm.image) return 0;
+    if (shm.image->bits_per_pixel != 32) {
+        XDestroyImage(shm.image);
+        shm.image = NULL;
+        return 0;
+    }
+
+    shm.info.shmid = shmget(IPC_PRIVATE, shm.image->bytes_per_line * shm.image->height,
+                            IPC_CREAT | 0600);
+    if (shm.info.shmid < 0) {
+        XDestroyImage(shm.image);
+        shm.image = NULL;
+        return 0;
+    }
+    shm.info.shmaddr = shmat(shm.info.shmid, NULL, 0);
+    if (shm.info.shmaddr == (void *)-1) {
+        shmctl(shm.info.shmid, IPC_RMID, NULL);
+        XDestroyImage(shm.image);
+        shm.image = NULL;
+        return 0;
+    }
+    shm.image->data = shm.info.shmaddr;
+    shm.info.readOnly = False;
+
+    // Attaching fails asynchronously on remote displays, so sync and check
+    shm_attach_failed = 0;
+    XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+    XShmAttach(display, &shm.info);
+    XSync(display, False);
+    XSetErrorHandler(old_handler);
+    shmctl(shm.info.shmid, IPC_RMID, NULL);
+
+    if (shm_attach_failed) {
+        XDestroyImage(shm.image);
+        shmdt(shm.info.shmaddr);
+        shm.image = NULL;
+        return 0;
+    }
+
+    shm.completion_type = XShmGetEventBase(display) + ShmCompletion;
+    shm.pending = 0;
+    return 1;
+}
+
+int is_shm_completion(Display *display, XEvent *e, XPointer arg) {
+    (void)display;
+    (void)arg;
+    return e->type == shm.completion_type;
+}
+
+// Blocks until the server is done reading the previous frame
+void shm_wait(Display *display) {
+    if (!shm.pending) return;
+    XEvent e;
+    XIfEvent(display, &e, is_shm_completion, NULL);
+    shm.pending = 0;
+}
+
+void fb_clear(uint32_t *fb, int stride, int width, int height, uint32_t color) {
+    for (int y = 0; y < height; ++y) {
+        uint32_t *row = fb + (size_t)y * stride;
+        if (color == 0) {
+            memset(row, 0, width * sizeof(uint32_t));
+        } else {
+            for (int x = 0; x < width; ++x) row[x] = color;
+        }
+    }
+}
+
+// Bresenham line, clipped per pixel (boid lines are at most 16 pixels long)
+void fb_line(uint32_t *fb, int stride, int width, int height,
+             int x1, int y1, int x2, int y2, uint32_t color) {
+    int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
+    int dy = -abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+    int err = dx + dy;
+
+    for (;;) {
+        if ((unsigned)x1 < (unsigned)width && (unsigned)y1 < (unsigned)height) {
+            fb[(size_t)y1 * stride + x1] = color;
+        }
+        if (x1 == x2 && y1 == y2) break;
+        int e2 = 2 * err;
+        if (e2 >= dy) { err += dy; x1 += sx; }
+        if (e2 <= dx) { err += dx; y1 += sy; }
+    }
+}
+
+void rasterize_boids(uint32_t *fb, int stride, int width, int height, uint32_t foreground) {
+    for (int i = 0; i < view.count; ++i) {
+        int x1 = (int)view.x[i];
+        int y1 = (int)view.y[i];
+        int x2 = x1 + (int)(view.vx[i] * 4);
+        int y2 = y1 + (int)(view.vy[i] * 4);
+        fb_line(fb, stride, width, height, x1, y1, x2, y2, foreground);
+    }
+}
+
+typedef struct {
+    uint32_t *fb;
+    int stride;
+    uint32_t background, foreground;
+} RasterArgs;
+
+// Pool job for tiled MIT-SHM frames: clears and draws tiles [begin, end)
+// into their own part of the image, so tiles never write the same pixels
+void rasterize_tiles(int begin, int end, void *arg) {
+    RasterArgs *args = arg;
+    for (int t = begin; t < end; ++t) {
+        Tile *tile = &tiles[t];
+        uint32_t *origin = args->fb + (size_t)tile->y * args->stride + tile->x;
+        fb_clear(origin, args->stride, tile->width, tile->height, args->background);
+
+        int last = tile->end < view.count ? tile->end : view.count;
+        for (int k = tile->begin; k < last + tile->num_ghosts; ++k) {
+            int i = k < last ? k : tile->ghosts[k - last];
+            if (i >= view.count) continue;
+            int x1 = (int)view.x[i] - tile->x;
+            int y1 = (int)view.y[i] - tile->y;
+            int x2 = x1 + (int)(view.vx[i] * 4);
+            int y2 = y1 + (int)(view.vy[i] * 4);
+            fb_line(origin, args->stride, tile->width, tile->height, x1, y1, x2, y2,
+                    args->foreground);
+        }
+    }
+}
+
+// Damage tracking for --damage. Each frame marks the tiles its boids touch;
+// only tiles touched this frame or the last one need clearing and copying.
+// The damaged tiles are returned as rectangles merged along tile rows, in
+// YXBanded order.
+typedef struct {
+    int tiles_x, tiles_y;
+    unsigned char *prev, *cur;
+    XRectangle *rects;
+    int full;            // next frame must be redrawn completely
+} DamageMap;
+
+DamageMap damage = { 0 };
+
+void damage_resize(int width, int height) {
+    int tiles_x = (width + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    int tiles_y = (height + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    int tiles = tiles_x * tiles_y;
+
+    if (tiles > damage.tiles_x * damage.tiles_y) {
+        free(damage.prev);
+        free(damage.cur);
+        free(damage.rects);
+        damage.prev = malloc(tiles);
+        damage.cur = malloc(tiles);
+        damage.rects = malloc(tiles * sizeof(XRectangle));
+        if (!damage.prev || !damage.cur || !damage.rects) {
+            fprintf(stderr, "boids: out of memory\n");
+            exit(1);
+        }
+    }
+    damage.tiles_x = tiles_x;
+    damage.tiles_y = tiles_y;
+    memset(damage.prev, 0, tiles);
+    memset(damage.cur, 0, tiles);
+    damage.full = 1;
+}
+
+void damage_mark(int x1, int y1, int x2, int y2, int width, int height) {
+    int left = x1 < x2 ? x1 : x2, right = x1 < x2 ? x2 : x1;
+    int top = y1 < y2 ? y1 : y2, bottom = y1 < y2 ? y2 : y1;
+    if (right < 0 || bottom < 0 || left >= width || top >= height) return;
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if (right >= width) right = width - 1;
+    if (bottom >= height) bottom = height - 1;
+
+    for (int ty = top / DAMAGE_TILE; ty <= bottom / DAMAGE_TILE; ++ty) {
+        for (int tx = left / DAMAGE_TILE; tx <= right / DAMAGE_TILE; ++tx) {
+            damage.cur[ty * damage.tiles_x + tx] = 1;
+        }
+    }
+}
+
+// Marks this frame's boids and returns the number of damaged rectangles
+int damage_update(int width, int height) {
+    for (int i = 0; i < view.count; ++i) {
+        int x1 = (int)view.x[i];
+        int y1 = (int)view.y[i];
+        if (render_backend == RENDER_POINTS) {
+            damage_mark(x1, y1, x1, y1, width, height);
+        } else {
+            damage_mark(x1, y1, x1 + (int)(view.vx[i] * 4), y1 + (int)(view.vy[i] * 4),
+                        width, height);
+        }
+    }
+
+    int n = 0;
+    if (damage.full) {
+        damage.rects[n++] = (XRectangle){ 0, 0, width, height };
+        damage.full = 0;
+    } else {
+        for (int ty = 0; ty < damage.tiles_y; ++ty) {
+            unsigned char *prev = damage.prev + ty * damage.tiles_x;
+            unsigned char *cur = damage.cur + ty * damage.tiles_x;
+            for (int tx = 0; tx < damage.tiles_x; ++tx) {
+                if (!prev[tx] && !cur[tx]) continue;
+                int start = tx;
+                while (tx + 1 < damage.tiles_x && (prev[tx + 1] || cur[tx + 1])) tx++;
+
+                int x = start * DAMAGE_TILE, y = ty * DAMAGE_TILE;
+                int w = (tx + 1) * DAMAGE_TILE - x, h = DAMAGE_TILE;
+                if (x + w > width) w = width - x;
+                if (y + h > height) h = height - y;
+                damage.rects[n++] = (XRectangle){ x, y, w, h };
+            }
+        }
+    }
+
+    unsigned char *swap = damage.prev;
+    damage.prev = damage.cur;
+    damage.cur = swap;
+    memset(damage.cur, 0, damage.tiles_x * damage.tiles_y);
+    return n;
+}
+
+void fb_clear_rects(uint32_t *fb, int stride, XRectangle *rects, int n, uint32_t color) {
+    for (int r = 0; r < n; ++r) {
+        fb_clear(fb + (size_t)rects[r].y * stride + rects[r].x, stride,
+                 rects[r].width, rects[r].height, color);
+    }
+}
+
+#ifdef USE_GL
+// OpenGL backend. Boids are streamed every frame into a persistently mapped
+// buffer split into GL_REGIONS parts, so the CPU can fill one part while the
+// GPU still reads the others; a fence per part says when it is free again.
+// Each boid is one instance of a two-vertex line, expanded in the vertex
+// shader. Without GL_ARB_buffer_storage the buffer is refilled with
+// glBufferData instead.
+#define GL_REGIONS 3
+
+#define GL_FUNCTIONS(X)                                         \
+    X(PFNGLGENBUFFERSPROC, GenBuffers)                          \
+    X(PFNGLDELETEBUFFERSPROC, DeleteBuffers)                    \
+    X(PFNGLBINDBUFFERPROC, BindBuffer)                          \
+    X(PFNGLBUFFERDATAPROC, BufferData)                          \
+    X(PFNGLMAPBUFFERRANGEPROC, MapBufferRange)                  \
+    X(PFNGLUNMAPBUFFERPROC, UnmapBuffer)                        \
+    X(PFNGLGENVERTEXARRAYSPROC, GenVertexArrays)                \
+    X(PFNGLBINDVERTEXARRAYPROC, BindVertexArray)                \
+    X(PFNGLENABLEVERTEXATTRIBARRAYPROC, EnableVertexAttribArray) \
+    X(PFNGLVERTEXATTRIBPOINTERPROC, VertexAttribPointer)        \
+    X(PFNGLVERTEXATTRIBDIVISORPROC, VertexAttribDivisor)        \
+    X(PFNGLDRAWARRAYSINSTANCEDPROC, DrawArraysInstanced)        \
+    X(PFNGLCREATESHADERPROC, CreateShader)                      \
+    X(PFNGLSHADERSOURCEPROC, ShaderSource)                      \
+    X(PFNGLCOMPILESHADERPROC, CompileShader)                    \
+    X(PFNGLGETSHADERIVPROC, GetShaderiv)                        \
+    X(PFNGLGETSHADERINFOLOGPROC, GetShaderInfoLog)              \
+    X(PFNGLCREATEPROGRAMPROC, CreateProgram)                    \
+    X(PFNGLATTACHSHADERPROC, AttachShader)                      \
+    X(PFNGLBINDATTRIBLOCATIONPROC, BindAttribLocation)          \
+    X(PFNGLLINKPROGRAMPROC, LinkProgram)                        \
+    X(PFNGLGETPROGRAMIVPROC, GetProgramiv)                      \
+    X(PFNGLUSEPROGRAMPROC, UseProgram)                          \
+    X(PFNGLGETUNIFORMLOCATIONPROC, GetUniformLocation)          \
+    X(PFNGLUNIFORM2FPROC, Uniform2f)                            \
+    X(PFNGLFENCESYNCPROC, FenceSync)                            \
+    X(PFNGLCLIENTWAITSYNCPROC, ClientWaitSync)                  \
+    X(PFNGLDELETESYNCPROC, DeleteSync)
+
+#define GL_DECLARE_FUNCTION(type, name) type name;
+#define GL_LOAD_FUNCTION(type, name)                                    \
+    gl.name = (type)glXGetProcAddress((const GLubyte *)"gl" #name);     \
+    if (!gl.name) return 0;
+
+struct {
+    GL_FUNCTIONS(GL_DECLARE_FUNCTION)
+    PFNGLBUFFERSTORAGEPROC BufferStorage;   // optional
+} gl;
+
+typedef struct {
+    GLXContext context;
+    int double_buffered;
+    GLuint program, vao, vbo;
+    GLint size_uniform;
+    int capacity;           // boids per region
+    float *mapped;          // persistent mapping, NULL when not available
+    GLsync fences[GL_REGIONS];
+    int region;
+    GLuint hud_lists;       // display lists of the HUD font, 0 if it did not load
+} GlRenderer;
+
+GlRenderer gl_renderer = { 0 };
+
+// GLSL 1.30 so that the legacy contexts glXCreateContext hands out can run
+// it; the boid attribute is bound to location 0 before linking
+const char *gl_vertex_shader =
+    "#version 130\n"
+    "in vec4 boid;\n"   // x, y, vx, vy
+    "uniform vec2 size;\n"
+    "void main() {\n"
+    "    vec2 p = boid.xy + boid.zw * (4.0 * float(gl_VertexID));\n"
+    "    vec2 ndc = (p + 0.5) / size * 2.0 - 1.0;\n"
+    "    gl_Position = vec4(ndc.x, -ndc.y, 0.0, 1.0);\n"
+    "}\n";
+
+const char *gl_fragment_shader =
+    "#version 130\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    color = vec4(1.0);\n"
+    "}\n";
+
+GLuint gl_compile(GLenum type, const char *source) {
+    GLuint shader = gl.CreateShader(type);
+    gl.ShaderSource(shader, 1, &source, NULL);
+    gl.CompileShader(shader);
+
+    GLint ok = 0;
+    gl.GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[512];
+        gl.GetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "boids: shader compile failed: %s\n", log);
+        return 0;
+    }
+    return shader;
+}
+
+int gl_load_functions(void) {
+    GL_FUNCTIONS(GL_LOAD_FUNCTION)
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (extensions && strstr(extensions, "GL_ARB_buffer_storage")) {
+        gl.BufferStorage = (PFNGLBUFFERSTORAGEPROC)
+            glXGetProcAddress((const GLubyte *)"glBufferStorage");
+    }
+    return 1;
+}
+
+// (Re)creates the instance buffer for capacity boids per region
+void gl_alloc_buffer(int capacity) {
+    GlRenderer *r = &gl_renderer;
+    for (int i = 0; i < GL_REGIONS; ++i) {
+        if (r->fences[i]) {
+            gl.DeleteSync(r->fences[i]);
+            r->fences[i] = NULL;
+        }
     }
-}
+    if (r->vbo) gl.DeleteBuffers(1, &r->vbo);
 
-void init_boids(int width, int height) {
-    for (int i = 0; i < NUM_BOIDS; ++i) {
-        boids[i].x = rand() % width;
-        boids[i].y = rand() % height;
-        boids[i].vx = ((rand() % 100) / 50.0f - 1.0f) * MAX_SPEED;
-        boids[i].vy = ((rand() % 100) / 50.0f - 1.0f) * MAX_SPEED;
-        boids[i].target_x = boids[i].x;
-        boids[i].target_y = boids[i].y;
-        boids[i].index = i;
+    gl.GenBuffers(1, &r->vbo);
+    gl.BindBuffer(GL_ARRAY_BUFFER, r->vbo);
+    GLsizeiptr bytes = (GLsizeiptr)capacity * 4 * sizeof(float);
+    r->mapped = NULL;
+    if (gl.BufferStorage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        gl.BufferStorage(GL_ARRAY_BUFFER, bytes * GL_REGIONS, NULL, flags);
+        r->mapped = gl.MapBufferRange(GL_ARRAY_BUFFER, 0, bytes * GL_REGIONS, flags);
+    }
+    if (!r->mapped) {
+        gl.BufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW);
     }
+    r->capacity = capacity;
+    r->region = 0;
 }
 
-void calculate_lissajous_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float a = 3, b = 2;
-    *x = width/2 + scale * sin(a * t);
-    *y = height/2 + scale * sin(b * t + PI/2);
-}
+// Sets up GL on the existing window, whatever created it (our own window,
+// XSCREENSAVER_WINDOW or the root window), using the window's own visual
+int gl_create(Display *display, Window win, XWindowAttributes *attr) {
+    GlRenderer *r = &gl_renderer;
+    XVisualInfo template = { .visualid = XVisualIDFromVisual(attr->visual) };
+    int count = 0;
+    XVisualInfo *vi = XGetVisualInfo(display, VisualIDMask, &template, &count);
+    if (!vi) return 0;
 
-void calculate_rose_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float k = 3;
-    float r = scale * sin(k * t);
-    *x = width/2 + r * cos(t);
-    *y = height/2 + r * sin(t);
-}
+    int use_gl = 0;
+    glXGetConfig(display, vi, GLX_USE_GL, &use_gl);
+    glXGetConfig(display, vi, GLX_DOUBLEBUFFER, &r->double_buffered);
+    r->context = use_gl ? glXCreateContext(display, vi, NULL, True) : NULL;
+    XFree(vi);
+    if (!r->context) return 0;
 
-void calculate_hypocycloid_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float R = scale;
-    float r = R/4;
-    float d = r;
-    
-    *x = width/2 + (R-r) * cos(t) + d * cos((R-r)*t/r);
-    *y = height/2 + (R-r) * sin(t) - d * sin((R-r)*t/r);
-}
+    if (!glXMakeCurrent(display, win, r->context) || !gl_load_functions()) {
+        glXMakeCurrent(display, None, NULL);
+        glXDestroyContext(display, r->context);
+        r->context = NULL;
+        return 0;
+    }
 
-void calculate_butterfly_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float r = exp(cos(t)) - 2 * cos(4*t) + pow(sin(t/12), 5);
-    *x = width/2 + scale/2 * sin(t) * r;
-    *y = height/2 + scale/2 * cos(t) * r;
-}
+    GLuint vs = gl_compile(GL_VERTEX_SHADER, gl_vertex_shader);
+    GLuint fs = gl_compile(GL_FRAGMENT_SHADER, gl_fragment_shader);
+    GLint linked = 0;
+    if (vs && fs) {
+        r->program = gl.CreateProgram();
+        gl.AttachShader(r->program, vs);
+        gl.AttachShader(r->program, fs);
+        gl.BindAttribLocation(r->program, 0, "boid");
+        gl.LinkProgram(r->program);
+        gl.GetProgramiv(r->program, GL_LINK_STATUS, &linked);
+    }
+    if (!linked) {
+        glXMakeCurrent(display, None, NULL);
+        glXDestroyContext(display, r->context);
+        r->context = NULL;
+        return 0;
+    }
+    r->size_uniform = gl.GetUniformLocation(r->program, "size");
 
-void calculate_maurer_rose_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height) * 1.5;
-    float n = 7;
-    float d = 71;
-    float k = t * d;
-    float r = scale * (0.8 + 0.2 * sin(n * k * PI/180));
-    *x = width/2 + r * cos(k * PI/180);
-    *y = height/2 + r * sin(k * PI/180);
-}
+    gl.GenVertexArrays(1, &r->vao);
+    gl.BindVertexArray(r->vao);
+    gl_alloc_buffer(boid_capacity);
+    glClearColor(0, 0, 0, 1);
 
-void calculate_spirograph_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float R = scale * 0.8;
-    float r = R * 0.4;
-    float d = r * 0.8;
-    
-    *x = width/2 + (R-r) * cos(t) + d * cos((R-r) * t/r);
-    *y = height/2 + (R-r) * sin(t) - d * sin((R-r) * t/r);
+    // The HUD uses the server's "fixed" font, as the X renderers' default GC does
+    XFontStruct *font = XLoadQueryFont(display, "fixed");
+    if (font) {
+        r->hud_lists = glGenLists(96);
+        glXUseXFont(font->fid, 32, 96, r->hud_lists);
+        XFreeFont(display, font);
+    }
+    return 1;
 }
 
-void calculate_fermat_spiral_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float a = scale * 0.5;
-    float r = a * sqrt(t);
-    float angle = t * 5;
-    
-    *x = width/2 + r * cos(angle);
-    *y = height/2 + r * sin(angle);
+void gl_destroy(Display *display) {
+    if (!gl_renderer.context) return;
+    glXMakeCurrent(display, None, NULL);
+    glXDestroyContext(display, gl_renderer.context);
+    gl_renderer.context = NULL;
 }
 
-void calculate_cardioid_position(float t, float *x, float *y, int width, int height) {
-    float scale = get_scale_factor(width, height);
-    float a = scale * 0.9;
-    float r = a * (1 + cos(t));
-    
-    *x = width/2 + r * cos(t);
-    *y = height/2 + r * sin(t);
+// Draws the HUD lines as glXUseXFont bitmaps through the fixed-function
+// pipeline, which the legacy context from glXCreateContext still has
+void gl_draw_hud(GlRenderer *r, int width, int height) {
+    gl.UseProgram(0);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, width, height, 0, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glColor3f(1, 1, 1);
+    glListBase(r->hud_lists - 32);
+    for (int l = 0; l < HUD_LINES; ++l) {
+        glRasterPos2i(8, 8 + HUD_LINE_HEIGHT * (l + 1));
+        glCallLists(strlen(hud_lines[l]), GL_UNSIGNED_BYTE, hud_lines[l]);
+    }
 }
 
-void apply_separation_force(Boid *boid, float weight) {
-    float avoid_x = 0, avoid_y = 0;
-    int count = 0;
+void gl_render(Display *display, Window win, int width, int height) {
+    GlRenderer *r = &gl_renderer;
+    if (view.count > r->capacity) gl_alloc_buffer(view.count + view.count / 2);
 
-    for (int j = 0; j < NUM_BOIDS; ++j) {
-        if (boid->index == j) continue;
-        float dx = boids[j].x - boid->x;
-        float dy = boids[j].y - boid->y;
-        float dist = sqrtf(dx * dx + dy * dy);
-        if (dist < NEIGHBOR_RADIUS/2 && dist > 0) {
-            avoid_x -= dx;
-            avoid_y -= dy;
-            count++;
+    float *dst;
+    size_t region_offset = 0;
+    if (r->mapped) {
+        // Wait until the GPU is done with the region we are about to refill
+        if (r->fences[r->region]) {
+            gl.ClientWaitSync(r->fences[r->region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            gl.DeleteSync(r->fences[r->region]);
+            r->fences[r->region] = NULL;
         }
+        region_offset = (size_t)r->region * r->capacity * 4;
+        dst = r->mapped + region_offset;
+    } else {
+        gl.BufferData(GL_ARRAY_BUFFER, (GLsizeiptr)r->capacity * 4 * sizeof(float),
+                      NULL, GL_STREAM_DRAW);
+        dst = gl.MapBufferRange(GL_ARRAY_BUFFER, 0, view.count * 4 * sizeof(float),
+                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
     }
 
-    if (count > 0) {
-        boid->vx += avoid_x * weight;
-        boid->vy += avoid_y * weight;
+    for (int i = 0; i < view.count; ++i) {
+        dst[4 * i + 0] = view.x[i];
+        dst[4 * i + 1] = view.y[i];
+        dst[4 * i + 2] = view.vx[i];
+        dst[4 * i + 3] = view.vy[i];
+    }
+    if (!r->mapped) gl.UnmapBuffer(GL_ARRAY_BUFFER);
+
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT);
+    gl.UseProgram(r->program);
+    gl.Uniform2f(r->size_uniform, width, height);
+    gl.EnableVertexAttribArray(0);
+    gl.VertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0,
+                           (const void *)(region_offset * sizeof(float)));
+    gl.VertexAttribDivisor(0, 1);
+    gl.DrawArraysInstanced(GL_LINES, 0, 2, view.count);
+    if (show_hud && r->hud_lists) gl_draw_hud(r, width, height);
+
+    if (r->mapped) {
+        r->fences[r->region] = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        r->region = (r->region + 1) % GL_REGIONS;
+    }
+
+    if (r->double_buffered) {
+        glXSwapBuffers(display, win);
+    } else {
+        glFlush();
     }
 }
+#endif
 
-void apply_pattern_force(Boid *boid, int width, int height) {
-    float target_x = 0, target_y = 0;
-    float t = (float)(boid->index) / NUM_BOIDS * 10.0 + pattern_time;
-    // Keyboard stuff
-    switch(current_mode) {
-        case MODE_LISSAJOUS:
-            calculate_lissajous_position(t, &target_x, &target_y, width, height);
+// Applies a key press to the simulation state (mode, flock size, snapshots)
+void handle_key(KeySym key, int width, int height, const char *save_path) {
+    switch(key) {
+        case XK_l:
+        case XK_L:
+            set_mode((current_mode == MODE_LISSAJOUS) ? MODE_NORMAL : MODE_LISSAJOUS);
+            break;
+        case XK_r:
+        case XK_R:
+            set_mode((current_mode == MODE_ROSE) ? MODE_NORMAL : MODE_ROSE);
+            break;
+        case XK_y:
+        case XK_Y:
+            set_mode((current_mode == MODE_HYPOCYCLOID) ? MODE_NORMAL : MODE_HYPOCYCLOID);
             break;
-        case MODE_ROSE:
-            calculate_rose_position(t, &target_x, &target_y, width, height);
+        case XK_b:
+        case XK_B:
+            set_mode((current_mode == MODE_BUTTERFLY) ? MODE_NORMAL : MODE_BUTTERFLY);
             break;
-        case MODE_HYPOCYCLOID:
-            calculate_hypocycloid_position(t, &target_x, &target_y, width, height);
+        case XK_m:
+        case XK_M:
+            set_mode((current_mode == MODE_MAURER_ROSE) ? MODE_NORMAL : MODE_MAURER_ROSE);
             break;
-        case MODE_BUTTERFLY:
-            calculate_butterfly_position(t, &target_x, &target_y, width, height);
+        case XK_s:
+        case XK_S:
+            set_mode((current_mode == MODE_SPIROGRAPH) ? MODE_NORMAL : MODE_SPIROGRAPH);
             break;
-        case MODE_MAURER_ROSE:
-            calculate_maurer_rose_position(t, &target_x, &target_y, width, height);
+        case XK_f:
+        case XK_F:
+            set_mode((current_mode == MODE_FERMAT_SPIRAL) ? MODE_NORMAL : MODE_FERMAT_SPIRAL);
             break;
-        case MODE_SPIROGRAPH:
-            calculate_spirograph_position(t, &target_x, &target_y, width, height);
+        case XK_c:
+        case XK_C:
+            set_mode((current_mode == MODE_CARDIOID) ? MODE_NORMAL : MODE_CARDIOID);
             break;
-        case MODE_FERMAT_SPIRAL:
-            calculate_fermat_spiral_position(t, &target_x, &target_y, width, height);
+        case XK_n:
+        case XK_N:
+            set_mode(MODE_NORMAL);
             break;
-        case MODE_CARDIOID:
-            calculate_cardioid_position(t, &target_x, &target_y, width, height);
+        case XK_plus:
+        case XK_equal:
+        case XK_KP_Add:
+            resize_flock(num_boids + BOIDS_STEP, width, height);
+            break;
+        case XK_minus:
+        case XK_KP_Subtract:
+            resize_flock(num_boids - BOIDS_STEP, width, height);
+            break;
+        case XK_w:
+        case XK_W:
+            if (save_path) save_snapshot(save_path, width, height);
             break;
         default:
-            return;
+            // 1-9 toggle the modes loaded with --patterns
+            if (key >= XK_1 && key <= XK_9 && NUM_MODES + (int)(key - XK_1) < num_modes) {
+                FlockingMode mode = NUM_MODES + (key - XK_1);
+                set_mode(current_mode == mode ? MODE_NORMAL : mode);
+            }
+            break;
     }
+}
 
-    float dx = target_x - boid->x;
-    float dy = target_y - boid->y;
-    float dist = sqrtf(dx * dx + dy * dy);
-    
-    if (dist > 0) {
-        boid->vx += (dx / dist) * PATTERN_FORCE;
-        boid->vy += (dy / dist) * PATTERN_FORCE;
+// Runs as many fixed simulation steps as elapsed wall time (plus what was
+// left over in *accumulator) asks for, adding their cost to st. Returns how
+// far the frame is into the next step, for interpolation.
+float advance_simulation(double *accumulator, double elapsed, int width, int height,
+                         FrameStats *st) {
+    double step_dt = SIM_DT * step_scale;
+    *accumulator += elapsed;
+    for (int substeps = 0; *accumulator >= step_dt; ++substeps) {
+        if (substeps == MAX_SUBSTEPS) {
+            *accumulator = fmod(*accumulator, step_dt);
+            break;
+        }
+        save_previous_positions();
+        *accumulator -= step_dt;
+        if (replay.map) {
+            replay_frame(width, height);
+            if (num_tiles > 1) partition_flock(width, height);
+            continue;
+        }
+        update_boids(width, height);
+        if (record_file) record_frame(width, height);
+
+        st->phase[PHASE_NEIGHBORS] += step_timing.grid;
+        st->phase[PHASE_FORCES] += step_timing.forces + step_timing.integrate;
+        st->neighbors += step_neighbors;
+        st->boid_steps += num_boids;
     }
-    
-    apply_separation_force(boid, PATTERN_SEPARATION_WEIGHT);
+    return *accumulator / step_dt;
 }
 
-FlockingMode get_next_pattern_mode() {
-    FlockingMode next_mode;
-    do {
-        next_mode = (rand() % 8) + 1;
-    } while (next_mode == last_pattern_mode);
-    last_pattern_mode = next_mode;
-    return next_mode;
+// --pipeline: the simulation runs on its own thread, a frame ahead of the
+// renderer. Every frame it hands over the interpolated positions and the
+// velocities through a triple buffer: it fills its back slot and swaps it
+// with the middle one, and the renderer swaps its front slot with the middle
+// one whenever that holds a frame it has not drawn yet. Neither side ever
+// waits for the other there. The flock itself belongs to the simulation
+// thread: key presses, the window size and whether anything is visible are
+// passed to it under pipeline.lock, which neither side holds for more than
+// a few copies.
+#define PIPELINE_FRESH 4
+// Key presses queued for the simulation thread per frame
+#define PIPELINE_KEYS 16
+
+typedef struct {
+    FrameView view;
+    int capacity;
+    FrameStats stats;   // cost of the steps behind this frame
+} FrameSlot;
+
+typedef struct {
+    FrameSlot slots[3];
+    int middle;         // slot index, | PIPELINE_FRESH while not drawn yet
+    int back, front;    // owned by the simulation and the renderer
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // Under lock
+    int width, height;  // the window the simulation steps in
+    int visible;        // the simulation sleeps while this is 0
+    KeySym keys[PIPELINE_KEYS];
+    int num_keys;
+    double render_cost; // the renderer's last draw + flush time
+    // Set before the thread starts
+    long period_ns;
+    const char *save_path;
+} Pipeline;
+
+int use_pipeline = 0;
+Pipeline pipeline = {
+    .middle = 1, .back = 0, .front = 2,
+    .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+    .visible = 1,
+};
+
+void reserve_slot(FrameSlot *slot, int count) {
+    if (count <= slot->capacity) return;
+    slot->capacity = count + count / 2;
+    FrameView *v = &slot->view;
+    v->x = realloc(v->x, slot->capacity * sizeof(float));
+    v->y = realloc(v->y, slot->capacity * sizeof(float));
+    v->vx = realloc(v->vx, slot->capacity * sizeof(float));
+    v->vy = realloc(v->vy, slot->capacity * sizeof(float));
+    if (!v->x || !v->y || !v->vx || !v->vy) {
+        fprintf(stderr, "boids: out of memory\n");
+        exit(1);
+    }
 }
 
-void check_auto_mode_timing() {
-    if (!auto_mode) return;
-    
-    time_t current_time = time(NULL);
-    int elapsed = current_time - last_mode_change;
-    
-    if (current_mode == MODE_NORMAL && elapsed >= BOIDS_TIME) {
-        current_mode = get_next_pattern_mode();
-        pattern_time = 0;
-        last_mode_change = current_time;
+void *pipeline_main(void *unused) {
+    (void)unused;
+    double accumulator = 0;
+    double last_frame = now_seconds();
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (1) {
+        pthread_mutex_lock(&pipeline.lock);
+        if (!pipeline.visible) {
+            while (!pipeline.visible) pthread_cond_wait(&pipeline.wake, &pipeline.lock);
+            accumulator = 0;
+            last_frame = now_seconds();
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        }
+        int width = pipeline.width, height = pipeline.height;
+        KeySym keys[PIPELINE_KEYS];
+        int num_keys = pipeline.num_keys;
+        memcpy(keys, pipeline.keys, num_keys * sizeof(KeySym));
+        pipeline.num_keys = 0;
+        double render_cost = pipeline.render_cost;
+        pthread_mutex_unlock(&pipeline.lock);
+
+        for (int k = 0; k < num_keys; ++k) {
+            handle_key(keys[k], width, height, pipeline.save_path);
+        }
+
+        FrameSlot *slot = &pipeline.slots[pipeline.back];
+        double start = now_seconds();
+        memset(&slot->stats, 0, sizeof(slot->stats));
+        check_auto_mode_timing();
+
+        double now = now_seconds();
+        slot->stats.phase[PHASE_AUTO] = now - start;
+        float alpha = advance_simulation(&accumulator, now - last_frame, width, height,
+                                         &slot->stats);
+        last_frame = now;
+
+        reserve_slot(slot, num_boids);
+        interpolate_positions(slot->view.x, slot->view.y, alpha, width, height);
+        memcpy(slot->view.vx, boids.vx, num_boids * sizeof(float));
+        memcpy(slot->view.vy, boids.vy, num_boids * sizeof(float));
+        slot->view.count = num_boids;
+        slot->view.mode = current_mode;
+        slot->view.level = governor.level;
+
+        int old = __atomic_exchange_n(&pipeline.middle, pipeline.back | PIPELINE_FRESH,
+                                      __ATOMIC_ACQ_REL);
+        pipeline.back = old & ~PIPELINE_FRESH;
+        // The two stages overlap, so a frame costs whichever is slower
+        governor_update(fmax(now_seconds() - start, render_cost));
+        wait_for_deadline(&deadline, pipeline.period_ns);
     }
-    else if (current_mode != MODE_NORMAL && elapsed >= PATTERN_TIME) {
-        current_mode = MODE_NORMAL;
-        pattern_time = 0;
-        last_mode_change = current_time;
+    return NULL;
+}
+
+void start_pipeline(int width, int height, long period_ns, const char *save_path) {
+    pipeline.width = width;
+    pipeline.height = height;
+    pipeline.period_ns = period_ns;
+    pipeline.save_path = save_path;
+    if (pthread_create(&pipeline.thread, NULL, pipeline_main, NULL) != 0) {
+        fprintf(stderr, "boids: cannot start the simulation thread\n");
+        exit(1);
     }
 }
 
-void update_boids(int width, int height) {
-    for (int i = 0; i < NUM_BOIDS; ++i) {
-        if (current_mode == MODE_NORMAL) {
-            float avg_vx = 0, avg_vy = 0;
-            float center_x = 0, center_y = 0;
-            float avoid_x = 0, avoid_y = 0;
-            int count = 0;
-
-            for (int j = 0; j < NUM_BOIDS; ++j) {
-                if (i == j) continue;
-                float dx = boids[j].x - boids[i].x;
-                float dy = boids[j].y - boids[i].y;
-                float dist = sqrtf(dx * dx + dy * dy);
-                if (dist < NEIGHBOR_RADIUS && dist > 0) {
-                    avg_vx += boids[j].vx;
-                    avg_vy += boids[j].vy;
-                    center_x += boids[j].x;
-                    center_y += boids[j].y;
-                    if (dist < NEIGHBOR_RADIUS / 2) {
-                        avoid_x -= dx;
-                        avoid_y -= dy;
-                    }
-                    count++;
-                }
-            }
+// Makes the newest frame from the simulation thread the view. Returns 0 if
+// there is none since the last call.
+int pipeline_take(void) {
+    if (!(__atomic_load_n(&pipeline.middle, __ATOMIC_ACQUIRE) & PIPELINE_FRESH)) return 0;
+    int old = __atomic_exchange_n(&pipeline.middle, pipeline.front, __ATOMIC_ACQ_REL);
+    pipeline.front = old & ~PIPELINE_FRESH;
+
+    FrameSlot *slot = &pipeline.slots[pipeline.front];
+    view = slot->view;
+    frame_stats.phase[PHASE_AUTO] += slot->stats.phase[PHASE_AUTO];
+    frame_stats.phase[PHASE_NEIGHBORS] += slot->stats.phase[PHASE_NEIGHBORS];
+    frame_stats.phase[PHASE_FORCES] += slot->stats.phase[PHASE_FORCES];
+    frame_stats.neighbors += slot->stats.neighbors;
+    frame_stats.boid_steps += slot->stats.boid_steps;
+    return 1;
+}
+
+// Hands a key press to the simulation thread; more than PIPELINE_KEYS in
+// one frame are dropped
+void pipeline_queue_key(KeySym key) {
+    pthread_mutex_lock(&pipeline.lock);
+    if (pipeline.num_keys < PIPELINE_KEYS) pipeline.keys[pipeline.num_keys++] = key;
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Tells the simulation thread how long the renderer took for its last frame
+void pipeline_report_render(double cost) {
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.render_cost = cost;
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Pauses or resumes the simulation thread
+void pipeline_set_visible(int visible) {
+    if (visible == pipeline.visible) return;
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.visible = visible;
+    pthread_cond_signal(&pipeline.wake);
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// --bench --render: the window the benchmark draws every step into, the
+// same way the main loop does. Without --render, display is NULL and only
+// the simulation is measured.
+typedef struct {
+    Display *display;
+    Window win;
+    Pixmap buffer;
+    GC gc;
+    unsigned long black, white;
+} BenchTarget;
+
+int is_map_notify(Display *display, XEvent *e, XPointer arg) {
+    (void)display;
+    return e->type == MapNotify && e->xmap.window == *(Window *)arg;
+}
+
+int open_bench_target(BenchTarget *t, int width, int height) {
+    t->display = XOpenDisplay(NULL);
+    if (!t->display) {
+        fprintf(stderr, "boids: --bench --render needs an X display\n");
+        return 1;
+    }
+    Display *display = t->display;
+    int screen = DefaultScreen(display);
+    t->black = BlackPixel(display, screen);
+    t->white = WhitePixel(display, screen);
+    t->win = XCreateSimpleWindow(display, RootWindow(display, screen), 0, 0, width, height,
+                                 0, t->black, t->black);
+    XSelectInput(display, t->win, StructureNotifyMask);
+    XMapWindow(display, t->win);
+    XEvent e;
+    XIfEvent(display, &e, is_map_notify, (XPointer)&t->win);
+
+    XWindowAttributes attr;
+    XGetWindowAttributes(display, t->win, &attr);
+    if (attr.width != width || attr.height != height) {
+        fprintf(stderr, "boids: the window manager resized the bench window\n");
+        return 1;
+    }
+    t->buffer = XCreatePixmap(display, t->win, width, height, DefaultDepth(display, screen));
+    t->gc = XCreateGC(display, t->win, 0, NULL);
+
+    // Unlike the main loop there is no fallback: the numbers would be
+    // reported under the wrong renderer
+    if (render_backend == RENDER_SHM && !shm_create(display, &attr, width, height)) {
+        fprintf(stderr, "boids: MIT-SHM not available\n");
+        return 1;
+    }
+#ifdef USE_GL
+    if (render_backend == RENDER_GL && !gl_create(display, t->win, &attr)) {
+        fprintf(stderr, "boids: OpenGL not available\n");
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// Draws the current flock and waits until the server (or the GPU) is done,
+// so the time measured is the whole cost of the frame
+void bench_draw(BenchTarget *t, int width, int height) {
+    Display *display = t->display;
+    view = (FrameView){ boids.x, boids.y, boids.vx, boids.vy,
+                        num_boids, current_mode, governor.level };
+
+    if (render_backend == RENDER_GL) {
+#ifdef USE_GL
+        gl_render(display, t->win, width, height);
+        glFinish();
+#endif
+        return;
+    }
+    if (render_backend == RENDER_SHM) {
+        uint32_t *fb = (uint32_t *)shm.image->data;
+        int stride = shm.image->bytes_per_line / 4;
+        fb_clear(fb, stride, width, height, t->black);
+        rasterize_boids(fb, stride, width, height, t->white);
+        XShmPutImage(display, t->win, t->gc, shm.image, 0, 0, 0, 0, width, height, False);
+    } else {
+        XSetForeground(display, t->gc, t->black);
+        XFillRectangle(display, t->buffer, t->gc, 0, 0, width, height);
+        XSetForeground(display, t->gc, t->white);
+        draw_boids(display, t->buffer, t->gc);
+        XCopyArea(display, t->buffer, t->win, t->gc, 0, 0, width, height, 0, 0);
+    }
+    XSync(display, False);
+}
+
+// Names the machine a benchmark ran on (its CPU model and online cores), for
+// the CSV's machine column; commas become spaces to keep the row intact
+void bench_machine(char *name, size_t size) {
+    char model[256] = "unknown cpu";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f) {
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) != 0 || !colon) continue;
+            colon += strspn(colon + 1, " \t") + 1;
+            colon[strcspn(colon, "\n")] = 0;
+            if (*colon) snprintf(model, sizeof(model), "%s", colon);
+            break;
+        }
+        fclose(f);
+    }
+    snprintf(name, size, "%s (%ld cores)", model, sysconf(_SC_NPROCESSORS_ONLN));
+    for (char *c = name; *c; ++c) {
+        if (*c == ',' || *c == '"') *c = ' ';
+    }
+}
+
+// Headless benchmark: runs the simulation for a fixed number of frames from
+// a fixed seed without touching X11 (unless target draws them). mode < 0
+// runs every mode in turn. With a snapshot every mode starts from that
+// flock instead of a fresh one, and save_path receives the state the last
+// mode finished in. csv, if set, gets one row per mode.
+int run_bench(int mode, int frames, int width, int height, uint64_t seed,
+              const char *snapshot_path, const char *save_path, const char *record_path,
+              BenchTarget *target, FILE *csv) {
+    double *step_times = malloc(frames * sizeof(double));
+    double *draw_times = malloc(frames * sizeof(double));
+    if (!step_times || !draw_times) {
+        fprintf(stderr, "boids: out of memory\n");
+        return 1;
+    }
+    const char *renderer = target->display ? render_names[render_backend] : "none";
+    char machine[300];
+    bench_machine(machine, sizeof(machine));
+
+    printf("boids bench: %d boids, %dx%d, %d frames, %d threads, renderer %s\n",
+           num_boids, width, height, frames, num_threads, renderer);
+    if (record_path) start_recording(record_path, width, height);
 
-            if (count > 0) {
-                avg_vx /= count;
-                avg_vy /= count;
-                center_x /= count;
-                center_y /= count;
+    for (int m = 0; m < num_modes; ++m) {
+        if (mode >= 0 && m != mode) continue;
 
-                boids[i].vx += (avg_vx - boids[i].vx) * ALIGNMENT_WEIGHT;
-                boids[i].vy += (avg_vy - boids[i].vy) * ALIGNMENT_WEIGHT;
-                boids[i].vx += (center_x - boids[i].x) * COHESION_WEIGHT;
-                boids[i].vy += (center_y - boids[i].y) * COHESION_WEIGHT;
-                boids[i].vx += avoid_x * SEPARATION_WEIGHT;
-                boids[i].vy += avoid_y * SEPARATION_WEIGHT;
+        if (snapshot_path) {
+            if (load_snapshot(snapshot_path, width, height) != 0) {
+                free(step_times);
+                free(draw_times);
+                return 1;
             }
         } else {
-            apply_pattern_force(&boids[i], width, height);
+            seed_random(seed);
+            sim_step = 0;
+            init_boids(width, height);
+            pattern_time = 0;
         }
+        current_mode = m;
+        transition_progress = 1;
 
-        limit_speed(&boids[i]);
-
-        boids[i].x += boids[i].vx;
-        boids[i].y += boids[i].vy;
+        StepTiming total = { 0, 0, 0 };
+        double start = now_seconds();
+        for (int f = 0; f < frames; ++f) {
+            double t = now_seconds();
+            update_boids(width, height);
+            step_times[f] = now_seconds() - t;
+            if (record_file) record_frame(width, height);
+            if (target->display) {
+                t = now_seconds();
+                bench_draw(target, width, height);
+                draw_times[f] = now_seconds() - t;
+            } else {
+                draw_times[f] = 0;
+            }
+            total.grid += step_timing.grid;
+            total.forces += step_timing.forces;
+            total.integrate += step_timing.integrate;
+        }
+        double elapsed = now_seconds() - start;
 
-        if (boids[i].x < 0) boids[i].x += width;
-        if (boids[i].y < 0) boids[i].y += height;
-        if (boids[i].x >= width) boids[i].x -= width;
-        if (boids[i].y >= height) boids[i].y -= height;
+        qsort(step_times, frames, sizeof(double), compare_doubles);
+        qsort(draw_times, frames, sizeof(double), compare_doubles);
+        double p50 = step_times[frames / 2] * 1e3, p99 = step_times[(frames * 99) / 100] * 1e3;
+        double draw_p50 = draw_times[frames / 2] * 1e3;
+        printf("%-12s %9.1f fps  step p50 %7.3f ms  p99 %7.3f ms  "
+               "grid %7.3f ms  forces %7.3f ms  integrate %7.3f ms",
+               mode_names[m], frames / elapsed, p50, p99,
+               total.grid / frames * 1e3, total.forces / frames * 1e3,
+               total.integrate / frames * 1e3);
+        if (target->display) printf("  draw p50 %7.3f ms", draw_p50);
+        printf("\n");
+        if (csv) {
+            fprintf(csv, "%d,%d,%d,%d,%d,%s,%s,%.1f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%s\n",
+                    num_boids, width, height, num_threads, frames, mode_names[m], renderer,
+                    frames / elapsed, p50, p99, total.grid / frames * 1e3,
+                    total.forces / frames * 1e3, total.integrate / frames * 1e3, draw_p50,
+                    machine);
+        }
     }
 
-    if (current_mode != MODE_NORMAL) {
-        pattern_time += 0.01;
-    }
+    free(step_times);
+    free(draw_times);
+    if (record_file) fclose(record_file);
+    if (save_path) return save_snapshot(save_path, width, height);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    Display *display = XOpenDisplay(NULL);
-    if (!display) return 1;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int bench = 0;
+    const char *mode_name = NULL;
+    int bench_frames = BENCH_FRAMES;
+    int bench_render = 0;   // --render given: --bench draws as well
+    const char *bench_csv = NULL;
+    int bench_width = BENCH_WIDTH, bench_height = BENCH_HEIGHT;
+    int target_fps = DEFAULT_FPS;
+    int use_damage = 0;
+    const char *stats_path = NULL;
+    uint64_t seed = 0;
+    int have_seed = 0;
+    const char *snapshot_path = NULL;
+    const char *save_path = NULL;
+    const char *record_path = NULL;
+    int tiles_x = 1, tiles_y = 1;
+    int net_node = -1;
+    const char *net_peers = NULL;
+    const char *replay_path = NULL;
 
-    // Check for auto mode
+    // Check for auto mode and options
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--auto") == 0) {
             auto_mode = 1;
             last_mode_change = time(NULL);
-            break;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            bench_render = 1;
+            if (strcmp(name, "lines") == 0) {
+                render_backend = RENDER_LINES;
+            } else if (strcmp(name, "segments") == 0) {
+                render_backend = RENDER_SEGMENTS;
+            } else if (strcmp(name, "points") == 0) {
+                render_backend = RENDER_POINTS;
+            } else if (strcmp(name, "shm") == 0) {
+                render_backend = RENDER_SHM;
+            } else if (strcmp(name, "gl") == 0) {
+#ifdef USE_GL
+                render_backend = RENDER_GL;
+#else
+                fprintf(stderr, "boids: built without OpenGL support (-DUSE_GL)\n");
+                return 1;
+#endif
+            } else {
+                fprintf(stderr, "boids: unknown renderer '%s'\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--boids") == 0 && i + 1 < argc) {
+            num_boids = atoi(argv[++i]);
+            if (num_boids < 1) {
+                fprintf(stderr, "boids: --boids needs a positive count\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            target_fps = atoi(argv[++i]);
+            if (target_fps < 1) {
+                fprintf(stderr, "boids: --fps needs a positive rate\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            governor.budget = atof(argv[++i]) / 1000.0;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+            have_seed = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &tiles_x, &tiles_y) != 2 ||
+                tiles_x < 1 || tiles_y < 1 || tiles_x > 64 || tiles_y > 64) {
+                fprintf(stderr, "boids: --tiles needs COLSxROWS, e.g. 3x1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--lod") == 0 && i + 1 < argc) {
+            lod_threshold = atoi(argv[++i]);
+            if (lod_threshold < 0) lod_threshold = 0;
+            if (lod_threshold > 0 && lod_threshold < LOD_MIN_CELL) lod_threshold = LOD_MIN_CELL;
+        } else if (strcmp(argv[i], "--transition") == 0 && i + 1 < argc) {
+            transition_seconds = atof(argv[++i]);
+            if (transition_seconds < 0) transition_seconds = 0;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            use_pipeline = 1;
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            compact_state = 1;
+        } else if (strcmp(argv[i], "--sort-interval") == 0 && i + 1 < argc) {
+            sort_interval = atoi(argv[++i]);
+            if (sort_interval < 0) sort_interval = 0;
+        } else if (strcmp(argv[i], "--net") == 0 && i + 1 < argc) {
+            net_node = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--peers") == 0 && i + 1 < argc) {
+            net_peers = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--damage") == 0) {
+            use_damage = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--bench-csv") == 0 && i + 1 < argc) {
+            bench_csv = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            bench_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+            if (load_patterns(argv[++i]) != 0) return 1;
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            mode_name = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &bench_width, &bench_height) != 2 ||
+                bench_width <= 0 || bench_height <= 0) {
+                fprintf(stderr, "boids: bad size '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+    // Resolved once every --patterns file is loaded, wherever --mode was given
+    int start_mode = MODE_NORMAL;
+    if (mode_name) {
+        start_mode = strcmp(mode_name, "all") == 0 ? -1 : parse_mode(mode_name);
+        if (start_mode < 0 && strcmp(mode_name, "all") != 0) {
+            fprintf(stderr, "boids: unknown mode '%s'\n", mode_name);
+            return 1;
+        }
+    }
+    start_workers(threads);
+    // Only the plain grid kernels read the compact copy
+    if (compact_state && (lod_threshold > 0 || net_node >= 0)) {
+        fprintf(stderr, "boids: --compact cannot be combined with --lod or --net\n");
+        return 1;
+    }
+    if (tiles_x * tiles_y > 1) {
+        if (use_damage || render_backend == RENDER_GL) {
+            fprintf(stderr, "boids: --tiles cannot be combined with --damage or --render gl\n");
+            return 1;
+        }
+        if (use_pipeline) {
+            fprintf(stderr, "boids: --tiles cannot be combined with --pipeline\n");
+            return 1;
+        }
+        // Migrants arriving over --net would land outside the tiles' slot ranges
+        if (net_node >= 0 || net_peers) {
+            fprintf(stderr, "boids: --tiles cannot be combined with --net\n");
+            return 1;
+        }
+        set_tiles(tiles_x, tiles_y);
+    }
+    if (net_node >= 0 || net_peers) {
+        if (!net_peers || net_node < 0 || bench || replay_path) {
+            fprintf(stderr, "boids: --net needs --peers and cannot be combined with --bench or --replay\n");
+            return 1;
         }
+        net_start(net_node, net_peers);
     }
 
+    if (bench) {
+        if (replay_path) {
+            fprintf(stderr, "boids: --replay cannot be combined with --bench\n");
+            return 1;
+        }
+        if (bench_frames < 1) bench_frames = 1;
+        BenchTarget target = { NULL };
+        if (bench_render && open_bench_target(&target, bench_width, bench_height) != 0) return 1;
+        FILE *csv = NULL;
+        if (bench_csv) {
+            csv = fopen(bench_csv, "a");
+            if (!csv) {
+                perror(bench_csv);
+                return 1;
+            }
+            // Appending lets a suite collect many runs in one file
+            if (ftell(csv) == 0) {
+                fprintf(csv, "boids,width,height,threads,frames,mode,renderer,fps,"
+                        "step_p50_ms,step_p99_ms,grid_ms,forces_ms,integrate_ms,draw_p50_ms,machine\n");
+            }
+        }
+        int status = run_bench(start_mode, bench_frames, bench_width, bench_height,
+                               have_seed ? seed : BENCH_SEED, snapshot_path, save_path,
+                               record_path, &target, csv);
+        if (csv) fclose(csv);
+        return status;
+    }
+
+    Display *display = XOpenDisplay(NULL);
+    if (!display) return 1;
+
     int screen = DefaultScreen(display);
     Window root = RootWindow(display, screen);
     Window win;
@@ -348,116 +4791,286 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    XSelectInput(display, win, KeyPressMask | KeyReleaseMask | StructureNotifyMask);
+    XSelectInput(display, win, KeyPressMask | KeyReleaseMask | StructureNotifyMask |
+                 VisibilityChangeMask | ExposureMask);
     XWindowAttributes attr;
     XGetWindowAttributes(display, win, &attr);
     int width = attr.width;
     int height = attr.height;
+    // Map and visibility changes are tracked by events from here on
+    int mapped = attr.map_state != IsUnmapped;
+    int obscured = 0;
 
-    // Create off-screen buffer
-    Pixmap buffer = XCreatePixmap(display, win, width, height, 
+    // Create off-screen buffer. It only ever grows; when the window shrinks
+    // only its top-left width x height part is drawn and copied.
+    int buffer_width = width, buffer_height = height;
+    Pixmap buffer = XCreatePixmap(display, win, buffer_width, buffer_height,
                                  DefaultDepth(display, screen));
 
     GC gc = XCreateGC(display, win, 0, NULL);
     XSetForeground(display, gc, WhitePixel(display, screen));
 
-    srand(time(NULL));
-    init_boids(width, height);
+    if (render_backend == RENDER_SHM && !shm_create(display, &attr, width, height)) {
+        fprintf(stderr, "boids: MIT-SHM not available, using XDrawSegments\n");
+        render_backend = RENDER_SEGMENTS;
+    }
+#ifdef USE_GL
+    if (render_backend == RENDER_GL && !gl_create(display, win, &attr)) {
+        fprintf(stderr, "boids: OpenGL not available, using XDrawSegments\n");
+        render_backend = RENDER_SEGMENTS;
+    }
+#endif
+    damage_resize(width, height);
+
+    if (replay_path) {
+        if (open_replay(replay_path) != 0) return 1;
+        replay_frame(width, height);
+        save_previous_positions();
+    } else if (snapshot_path) {
+        if (load_snapshot(snapshot_path, width, height) != 0) return 1;
+    } else {
+        seed_random(have_seed ? seed : (uint64_t)time(NULL));
+        init_boids(width, height);
+    }
+    // An explicit --mode starts there, without fading in
+    if (mode_name && start_mode >= 0) {
+        current_mode = start_mode;
+        pattern_time = 0;
+        transition_progress = 1;
+        num_fading = 0;
+        if (start_mode != MODE_NORMAL) last_pattern_mode = start_mode;
+    }
+
+    long frame_period_ns = 1000000000L / target_fps;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    double sim_accumulator = 0;
+    double last_frame = now_seconds();
 
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = 16666667; // 60 FPS aprox
+    if (stats_path) open_stats_file(stats_path);
+    if (record_path) start_recording(record_path, width, height);
+    frame_stats.start = last_frame;
+    if (use_pipeline) start_pipeline(width, height, frame_period_ns, save_path);
 
     while (1) {
+        double frame_start = now_seconds();
+        // A burst of ConfigureNotify events (or a move) is applied as a
+        // single resize once the queue is drained
+        int new_width = width, new_height = height;
         while (XPending(display)) {
             XEvent e;
             XNextEvent(display, &e);
             
-            if (e.type == ConfigureNotify) {
-                width = e.xconfigure.width;
-                height = e.xconfigure.height;
-                
-                // Recreate buffer with new size
-                XFreePixmap(display, buffer);
-                buffer = XCreatePixmap(display, win, width, height,
-                                     DefaultDepth(display, screen));
+            if (render_backend == RENDER_SHM && e.type == shm.completion_type) {
+                shm.pending = 0;
+            } else if (e.type == MapNotify) {
+                mapped = 1;
+            } else if (e.type == UnmapNotify) {
+                mapped = 0;
+            } else if (e.type == VisibilityNotify) {
+                obscured = e.xvisibility.state == VisibilityFullyObscured;
+            } else if (e.type == Expose && use_damage) {
+                // Uncovered parts of the window are repainted with the next
+                // frame; without --damage every frame repaints everything
+                XExposeEvent *x = &e.xexpose;
+                damage_mark(x->x, x->y, x->x + x->width - 1, x->y + x->height - 1, width, height);
+            } else if (e.type == ConfigureNotify) {
+                new_width = e.xconfigure.width;
+                new_height = e.xconfigure.height;
             } else if (e.type == KeyPress && !auto_mode) {
                 KeySym key = XLookupKeysym(&e.xkey, 0);
-                switch(key) {
-                    case XK_l:
-                    case XK_L:
-                        current_mode = (current_mode == MODE_LISSAJOUS) ? MODE_NORMAL : MODE_LISSAJOUS;
-                        pattern_time = 0;
-                        break;
-                    case XK_r:
-                    case XK_R:
-                        current_mode = (current_mode == MODE_ROSE) ? MODE_NORMAL : MODE_ROSE;
-                        pattern_time = 0;
-                        break;
-                    case XK_y:
-                    case XK_Y:
-                        current_mode = (current_mode == MODE_HYPOCYCLOID) ? MODE_NORMAL : MODE_HYPOCYCLOID;
-                        pattern_time = 0;
-                        break;
-                    case XK_b:
-                    case XK_B:
-                        current_mode = (current_mode == MODE_BUTTERFLY) ? MODE_NORMAL : MODE_BUTTERFLY;
-                        pattern_time = 0;
-                        break;
-                    case XK_m:
-                    case XK_M:
-                        current_mode = (current_mode == MODE_MAURER_ROSE) ? MODE_NORMAL : MODE_MAURER_ROSE;
-                        pattern_time = 0;
-                        break;
-                    case XK_s:
-                    case XK_S:
-                        current_mode = (current_mode == MODE_SPIROGRAPH) ? MODE_NORMAL : MODE_SPIROGRAPH;
-                        pattern_time = 0;
-                        break;
-                    case XK_f:
-                    case XK_F:
-                        current_mode = (current_mode == MODE_FERMAT_SPIRAL) ? MODE_NORMAL : MODE_FERMAT_SPIRAL;
-                        pattern_time = 0;
-                        break;
-                    case XK_c:
-                    case XK_C:
-                        current_mode = (current_mode == MODE_CARDIOID) ? MODE_NORMAL : MODE_CARDIOID;
-                        pattern_time = 0;
-                        break;
-                    case XK_n:
-                    case XK_N:
-                        current_mode = MODE_NORMAL;
-                        pattern_time = 0;
-                        break;
+                if (key == XK_h || key == XK_H) {
+                    show_hud = !show_hud;
+                    if (use_damage) damage.full = 1;
+                } else if (use_pipeline) {
+                    pipeline_queue_key(key);
+                } else {
+                    handle_key(key, width, height, save_path);
                 }
             }
         }
 
-        check_auto_mode_timing();
-        update_boids(width, height);
+        if (new_width != width || new_height != height) {
+            width = new_width;
+            height = new_height;
+
+            if (width > buffer_width || height > buffer_height) {
+                if (width > buffer_width) buffer_width = width;
+                if (height > buffer_height) buffer_height = height;
+                XFreePixmap(display, buffer);
+                buffer = XCreatePixmap(display, win, buffer_width, buffer_height,
+                                     DefaultDepth(display, screen));
+            }
+            if (render_backend == RENDER_SHM &&
+                (width > shm.image->width || height > shm.image->height)) {
+                shm_wait(display);
+                shm_destroy(display);
+                if (!shm_create(display, &attr, buffer_width, buffer_height)) {
+                    render_backend = RENDER_SEGMENTS;
+                }
+            }
+            // The grid and pattern tables notice the new size on the next step
+            damage_resize(width, height);
+            if (use_pipeline) {
+                pthread_mutex_lock(&pipeline.lock);
+                pipeline.width = width;
+                pipeline.height = height;
+                pthread_mutex_unlock(&pipeline.lock);
+            }
+        }
+
+        // Nothing on screen: sleep on the X connection instead of simulating
+        // and drawing, then pick the schedule up again from now
+        int visible = mapped && !obscured && !monitor_off(display);
+        if (use_pipeline) pipeline_set_visible(visible);
+        if (!visible) {
+            wait_for_x_events(display, IDLE_POLL);
+            last_frame = now_seconds();
+            sim_accumulator = 0;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            memset(&frame_stats, 0, sizeof(frame_stats));
+            frame_stats.start = last_frame;
+            continue;
+        }
+
+        double t_events = now_seconds();
+        frame_stats.phase[PHASE_EVENTS] += t_events - frame_start;
+        double now = t_events;
+        if (use_pipeline) {
+            // The simulation thread paces itself; only draw what is new
+            if (!pipeline_take()) {
+                wait_for_deadline(&deadline, frame_period_ns);
+                continue;
+            }
+        } else {
+            check_auto_mode_timing();
+
+            // Fixed timestep: run as many simulation steps as wall time asks for
+            now = now_seconds();
+            frame_stats.phase[PHASE_AUTO] += now - t_events;
+            float alpha = advance_simulation(&sim_accumulator, now - last_frame, width, height,
+                                             &frame_stats);
+            last_frame = now;
+            interpolate_positions(draw_x, draw_y, alpha, width, height);
+            view = (FrameView){ draw_x, draw_y, boids.vx, boids.vy,
+                                num_boids, current_mode, governor.level };
+        }
+        double t_draw = now_seconds();
+
+        // With --damage only tiles touched this frame or the last one are
+        // cleared and presented
+        int damaged = 0;
+        if (use_damage) {
+            if (show_hud) {
+                damage_mark(0, 0, HUD_WIDTH, HUD_LINE_HEIGHT * (HUD_LINES + 1), width, height);
+            }
+            damaged = damage_update(width, height);
+        }
+
+        if (render_backend == RENDER_GL) {
+#ifdef USE_GL
+            gl_render(display, win, width, height);
+#endif
+        } else if (num_tiles > 1) {
+            // Every tile clears, draws and presents only its own region
+            find_ghosts();
+            if (render_backend == RENDER_SHM) {
+                shm_wait(display);
+                RasterArgs args = {
+                    (uint32_t *)shm.image->data, shm.image->bytes_per_line / 4,
+                    BlackPixel(display, screen), WhitePixel(display, screen)
+                };
+                run_parallel_chunked(rasterize_tiles, num_tiles, 1, &args);
+                for (int t = 0; t < num_tiles; ++t) {
+                    Tile *tile = &tiles[t];
+                    XShmPutImage(display, win, gc, shm.image, tile->x, tile->y, tile->x, tile->y,
+                                 tile->width, tile->height, t == num_tiles - 1);
+                }
+                shm.pending = 1;
+                if (show_hud) draw_hud(display, win, gc);
+            } else {
+                for (int t = 0; t < num_tiles; ++t) {
+                    Tile *tile = &tiles[t];
+                    XSetForeground(display, gc, BlackPixel(display, screen));
+                    XFillRectangle(display, buffer, gc, tile->x, tile->y, tile->width, tile->height);
+                    XSetForeground(display, gc, WhitePixel(display, screen));
+                    draw_tile(display, buffer, gc, tile);
+                    if (show_hud && t == 0) draw_hud(display, buffer, gc);
+                    XCopyArea(display, buffer, win, gc, tile->x, tile->y,
+                              tile->width, tile->height, tile->x, tile->y);
+                }
+            }
+        } else if (render_backend == RENDER_SHM) {
+            shm_wait(display);
+            uint32_t *fb = (uint32_t *)shm.image->data;
+            int stride = shm.image->bytes_per_line / 4;
+            uint32_t black = BlackPixel(display, screen);
+
+            if (use_damage) {
+                fb_clear_rects(fb, stride, damage.rects, damaged, black);
+            } else {
+                fb_clear(fb, stride, width, height, black);
+            }
+            rasterize_boids(fb, stride, width, height, WhitePixel(display, screen));
+
+            if (use_damage) {
+                for (int r = 0; r < damaged; ++r) {
+                    XRectangle *rect = &damage.rects[r];
+                    XShmPutImage(display, win, gc, shm.image, rect->x, rect->y,
+                                 rect->x, rect->y, rect->width, rect->height, r == damaged - 1);
+                }
+                shm.pending = damaged > 0;
+            } else {
+                XShmPutImage(display, win, gc, shm.image, 0, 0, 0, 0, width, height, True);
+                shm.pending = 1;
+            }
+            if (show_hud) draw_hud(display, win, gc);
+        } else {
+            if (use_damage) {
+                XSetClipRectangles(display, gc, 0, 0, damage.rects, damaged, YXBanded);
+            }
 
-        // Clear buffer
-        XSetForeground(display, gc, BlackPixel(display, screen));
-        XFillRectangle(display, buffer, gc, 0, 0, width, height);
-        XSetForeground(display, gc, WhitePixel(display, screen));
+            // Clear buffer
+            XSetForeground(display, gc, BlackPixel(display, screen));
+            XFillRectangle(display, buffer, gc, 0, 0, width, height);
+            XSetForeground(display, gc, WhitePixel(display, screen));
 
-        // Draw to buffer
-        for (int i = 0; i < NUM_BOIDS; ++i) {
-            int x1 = (int)boids[i].x;
-            int y1 = (int)boids[i].y;
-            int x2 = x1 + (int)(boids[i].vx * 4);
-            int y2 = y1 + (int)(boids[i].vy * 4);
-            XDrawLine(display, buffer, gc, x1, y1, x2, y2);
+            // Draw to buffer
+            draw_boids(display, buffer, gc);
+            if (show_hud) draw_hud(display, buffer, gc);
+
+            // Copy buffer to window
+            XCopyArea(display, buffer, win, gc, 0, 0, width, height, 0, 0);
+            if (use_damage) {
+                XSetClipMask(display, gc, None);
+            }
         }
 
-        // Copy buffer to window
-        XCopyArea(display, buffer, win, gc, 0, 0, width, height, 0, 0);
+        double t_flush = now_seconds();
         XFlush(display);
-        
-        nanosleep(&sleep_time, NULL);
+        double frame_end = now_seconds();
+        frame_stats.phase[PHASE_DRAW] += t_flush - t_draw;
+        frame_stats.phase[PHASE_FLUSH] += frame_end - t_flush;
+        frame_stats.frames++;
+
+        if (use_pipeline) {
+            pipeline_report_render(frame_end - t_draw);
+        } else {
+            governor_update(frame_end - now);
+        }
+        report_frame_stats(frame_end);
+
+        frame_stats.missed += wait_for_deadline(&deadline, frame_period_ns);
     }
 
     // Cleanup
+    if (stats_file) fclose(stats_file);
+    if (record_file) fclose(record_file);
+    if (replay.map) munmap(replay.map, replay.size);
+#ifdef USE_GL
+    gl_destroy(display);
+#endif
+    shm_destroy(display);
     XFreePixmap(display, buffer);
     XFreeGC(display, gc);
     XCloseDisplay(display);